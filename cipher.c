@@ -9,6 +9,10 @@
  *
  * A line must consist of the following tokens in order:
  * 
+ * FORMAT: Optional. Indicates the block width of the permutation.
+ *         Legal values are '1' (28 bits, 4 characters, the default),
+ *         '2' (56 bits, 8 characters), '3' (112 bits, 16 characters) and
+ *         '4' (224 bits, 32 characters).
  * ACTION: Indicates if encryption of decryption should be perfromed.
  *         Legal values are 'e' for encryption and 'd' for decryption.
  * LCG_M:  Indicates the m value used for the linear congruential generator.
@@ -24,15 +28,146 @@
  * characters "This program is awesome!" using m = 38875 abd c = 1234 for the
  * linear congruential generator.
  *
+ * The same line in the 56-bit format: 2e38875,1234,This program is awesome!
+ *
+ * Wider blocks build one map for every 8, 16 or 32 characters instead of every
+ * 4, but they are not faster: every format takes one LCG step per bit, so all
+ * formats cost about the same per character. Data must be decrypted using the
+ * format it was encrypted with.
+ *
  * The program will print its output to the standard output stream.
+ *
+ * Options:
+ *
+ * -l, --latency: Low-latency mode. Output is flushed once per completed line
+ *                and a histogram of per-line latency is printed to the
+ *                standard error stream on exit.
+ *
+ * -c, --cache: Result cache. Whole lines are looked up in a cache of earlier
+ *              lines so repeated lines are answered without ciphering them.
+ *              Hit rate statistics are printed to the standard error stream
+ *              on exit. Lines longer than RESULT_CACHE_MAX_LINE bytes are
+ *              never cached.
+ *
+ * --cache-entries N: Limits the result cache to about N lines (default
+ *                    65536, at most RESULT_CACHE_MAX_ENTRIES). The table of
+ *                    entries is allocated up front, 32 bytes per entry on
+ *                    64-bit systems, with the number of entries rounded up
+ *                    to a power of two. Implies --cache.
+ *
+ * --cache-bytes N: Limits the result cache to N bytes of lines and outputs
+ *                  (default 16 MiB). The table of entries is not counted,
+ *                  see --cache-entries. Implies --cache.
+ *
+ * --write-index FILE: Writes a block index of every encrypted line to FILE.
+ *                     Each index line holds the input line number, the
+ *                     format version, K and the offset into the cipher text
+ *                     of every Kth block: "LINE VERSION K OFFSET...".
+ *                     Offsets are only written for blocks holding cipher
+ *                     text, so a line never ends with the offset of its end.
+ *                     The index command builds the same index by scanning
+ *                     the cipher text.
+ *                     Result cache hits are not used, since they would leave
+ *                     their lines out of the index.
+ *
+ * --index-every K: Sets K for --write-index and the index command (default
+ *                  16).
+ *
+ * --range X-Y: Prints only characters X to Y, counted from 0, of the plain
+ *              text of decrypted lines. Blocks before the range are skipped
+ *              without being decrypted and the LCG jumps straight to the
+ *              first block of the range.
+ *
+ * --index FILE: Block index used by --range to skip to the indexed block
+ *               nearest the range without parsing the blocks before it. The
+ *               index lines must be for the same input line numbers.
+ *
+ * -s, --stream: Reads the standard input stream in whatever chunks are
+ *               available and parses them with the streaming interface, see
+ *               feedCipherStream. Cannot be combined with the result cache,
+ *               block indexes or ranges.
+ *
+ * Commands:
+ *
+ * keygen M,C: Prints C source specialized for the key m = M, c = C in the
+ *             28-bit format instead of reading the standard input stream.
+ *             Building with -DKEYED includes it from keyed.h so lines using
+ *             that key run with constant LCG parameters and, when the map
+ *             sequence repeats within KEYGEN_MAX_PERIOD blocks, with the
+ *             maps baked in as tables. See the cipher-keyed make target.
+ *
+ * autotune SAMPLE: Times every tuning profile on the lines of the file SAMPLE
+ *                  and saves the fastest one. The profile is loaded by later
+ *                  runs from the file named by the environment variable
+ *                  CIPHER_PROFILE, or from .cipher_profile if it is not set.
+ *
+ * index [K]: Prints the block index of every decryption line on the standard
+ *            input stream, in the format written by --write-index, by
+ *            scanning the cipher text.
+ *
+ * Library:
+ *
+ * Building with -DCIPHER_LIBRARY leaves out main, so the streaming interface
+ * declared in cipherstream.h can be linked into other programs. See the
+ * libcipher.a make target.
  ******************************************************************************/
 #include <stdio.h>
 #include <string.h>
 #include <ctype.h>
 #include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <limits.h>
+#include <errno.h>
+
+#include "cipherstream.h"
 
 #define MAP_LENGTH 28
 
+//Widest block any format can use, in characters.
+#define MAX_BLOCK_CHARS CIPHER_MAX_BLOCK_CHARS
+#define MAX_MAP_LENGTH (MAX_BLOCK_CHARS * 7)
+
+//Maps at least this long find free spaces with a bitmask select, shorter
+//ones walk the spaces, which is faster for them. 64 spaces per mask word.
+#define MAP_SELECT_LENGTH 112
+#define MAP_WORDS ((MAX_MAP_LENGTH + 63) / 64)
+#define BYTE_ONES 0x0101010101010101ULL
+#define BYTE_HIGHS 0x8080808080808080ULL
+
+//Latency histogram layout: values below 2^HISTOGRAM_SUB_BITS nanoseconds are
+//recorded exactly, larger values keep HISTOGRAM_SUB_BITS significant bits, so
+//their relative error is below 1 / 2^(HISTOGRAM_SUB_BITS - 1).
+#define HISTOGRAM_SUB_BITS 5
+#define HISTOGRAM_BUCKETS 40
+
+//Longest map sequence, in blocks, that keygen bakes into a table.
+#define KEYGEN_MAX_PERIOD 4096
+
+//Number of maps the map cache keeps for the most recent key.
+#define MAP_CACHE_BLOCKS 1024
+
+//Largest stdout buffer a profile can select.
+#define MAX_OUTPUT_BUFFER (1 << 20)
+
+//Number of timed runs per profile when autotuning; the fastest counts.
+#define AUTOTUNE_ROUNDS 3
+
+//Longest line, including its '\n', the result cache keeps.
+#define RESULT_CACHE_MAX_LINE 4096
+
+//Number of entries sharing a bucket of the result cache.
+#define RESULT_CACHE_WAYS 4
+
+//Largest --cache-entries accepted.
+#define RESULT_CACHE_MAX_ENTRIES (1ULL << 24)
+
+//Number of blocks between offsets in a block index, unless --index-every.
+#define DEFAULT_INDEX_EVERY 16
+
+//Size of the chunks read from the standard input stream with --stream.
+#define STREAM_CHUNK 4096
+
 //Toggle specific debugging options.
 #define DEBUG_GENERAL 0
 #define DEBUG_ERROR 0
@@ -64,25 +199,226 @@ static unsigned long long lcg_a;
 static unsigned long long lcg_x;
 
 //For mapping.
-static unsigned int builtMap[MAP_LENGTH];
-static int assigned[MAP_LENGTH];
-static int assigned_index[MAP_LENGTH];
+static unsigned int builtMap[MAX_MAP_LENGTH];
+static int assigned[MAX_MAP_LENGTH];
+static int assigned_index[MAX_MAP_LENGTH];
+
+//For block formats. Each format has a map builder and permutation kernels
+//specialized for its block width, see DEFINE_BLOCK_FORMAT.
+struct blockFormat
+{
+  char version;
+  int block_chars;
+  void (* buildMap)(void);
+  void (* encryptBits)(const char * data, char * encrypted);
+  void (* decryptBits)(const char * decrypted, char * data);
+};
+
+static const struct blockFormat * block_format;
+
+//Index of the next block of the current line.
+static int map_block;
+
+//For the map cache. Each line restarts the LCG at its seed, so lines with the
+//same key and format use the same sequence of maps.
+static int map_cache_enabled = 0;
+static const struct blockFormat * map_cache_format;
+static unsigned long long map_cache_m;
+static unsigned long long map_cache_c;
+static int map_cache_filled;
+static unsigned char map_cache[MAP_CACHE_BLOCKS][MAX_MAP_LENGTH];
+static unsigned long long map_cache_x[MAP_CACHE_BLOCKS];
+
+//For the stdout buffer. 0 keeps the default buffering.
+static int output_buffer_size = 0;
+static char stdout_buffer[MAX_OUTPUT_BUFFER];
+
+//For the result cache. Each entry holds a line followed by the output it
+//produced, after the line number.
+struct cachedResult
+{
+  unsigned long long hash;
+  char * text;
+  int line_length;
+  int output_length;
+  int referenced;
+};
+
+static int result_cache_enabled = 0;
+static unsigned long long result_cache_entries = 65536;
+static unsigned long long result_cache_bytes = 16 << 20;
+static struct cachedResult * result_cache;
+static unsigned long long result_cache_buckets;
+static unsigned long long result_cache_hand;
+static unsigned long long result_cache_used;
+static unsigned long long result_cache_lookups;
+static unsigned long long result_cache_hits;
+static unsigned long long result_cache_evictions;
+
+//For line buffering. When the result cache is enabled each line is read into
+//line_buffer first and the parser reads from it through readChar.
+static char line_buffer[RESULT_CACHE_MAX_LINE];
+static int line_length = 0;
+static int line_position = 0;
+static int line_complete;
+static int line_at_eof;
+static int line_overrun;
+
+//For capturing the output of a line to store in the result cache.
+static char output_capture[2 * RESULT_CACHE_MAX_LINE + 16];
+static int output_length;
+static int output_capturing = 0;
+static int output_overflow;
+
+//For block indexes. While index_entry_open, cipher_offset counts the cipher
+//text characters of the current line.
+static FILE * index_out = NULL;
+static int index_every = DEFAULT_INDEX_EVERY;
+static int index_entry_open = 0;
+static unsigned long long cipher_offset;
+
+//For range decryption. index_in_line is the line number of the index line
+//being read from index_in.
+static int range_enabled = 0;
+static long long range_first;
+static long long range_last;
+static FILE * index_in = NULL;
+static long long index_in_line = 0;
+static int index_in_started = 0;
+
+static int stream_mode = 0;
+static int stream_line_open = 0;
+static struct timespec stream_line_start;
 
 //For prime factorization.
 int factors[100] = {0};
 
+//For low-latency mode.
+static int latency_mode = 0;
+static unsigned long long latency_counts[HISTOGRAM_BUCKETS]
+                                        [1 << HISTOGRAM_SUB_BITS];
+static unsigned long long latency_total = 0;
+static unsigned long long latency_max = 0;
+
+//For keyed builds, see writeKeyedSource.
+#ifdef KEYED
+#include "keyed.h"
+#endif
+
 //Function Prototypes
+int readChar(void);
+void writeOutput(const char * text);
 unsigned long long readNumber(char delimiter);
 void calculatePrimeFactors(unsigned long long number);
 void skipToEndOfLine(void);
 int readDataBlock(char * data);
 int readCipherMode(void);
 int buildLCG(void);
+int initLCG(void);
 void buildMap(void);
+void resetMapCache(void);
+const struct blockFormat * findBlockFormat(char version);
+#ifdef KEYED
+void buildMapKeyed(void);
+void selectKeyedFormat(void);
+#endif
+int writeKeyedSource(const char * key);
+const char * profilePath(void);
+int loadProfile(void);
+int saveProfile(void);
+int autotune(const char * sample);
+void cipherLines(void);
+void bufferLine(void);
+unsigned long long hashLine(void);
+int initResultCache(void);
+struct cachedResult * findResult(unsigned long long hash);
+void evictResult(struct cachedResult * entry);
+void storeResult(unsigned long long hash);
+void printResultCacheStats(void);
+void beginIndexEntry(int line);
+void endIndexEntry(void);
+int writeIndex(const char * every);
+int readIndexField(unsigned long long * value);
+unsigned long long findIndexOffset(int line, long long block,
+                                   long long * indexed_block);
+unsigned long long mulMod(unsigned long long x, unsigned long long y);
+void jumpLCG(unsigned long long steps);
+int skipBlocks(long long count);
+int seekToRange(int line);
 int isBitSet(char c, int n);
 void setBit(char * c, int n);
+int encryptBlock(const char * data, char * encrypted_formatted);
 int encryptText(char * data);
+int decryptBlock(const char * decrypted, char * decrypted_formatted);
 int decryptText(char * data);
+void streamWrite(struct cipherStream * stream, const char * text);
+void streamEndLine(struct cipherStream * stream, const char * text);
+void streamError(struct cipherStream * stream, int active_char);
+int streamNumber(struct cipherStream * stream, int active_char);
+int streamKey(struct cipherStream * stream);
+int streamBlock(struct cipherStream * stream);
+void streamChar(struct cipherStream * stream, int active_char);
+void writeStreamOutput(void * user, const char * text, size_t length);
+void endStreamLine(void * user, int line);
+unsigned long long elapsedNanoseconds(const struct timespec * start);
+void recordLatency(unsigned long long nanoseconds);
+unsigned long long latencyPercentile(double percentile);
+void printLatencyHistogram(void);
+
+
+
+/******************************************************************************/
+/* readChar(void)                                                             */
+/*   Reads the next character of input. Characters of the current line are    */
+/*   taken from line_buffer when it was filled by bufferLine, the rest come   */
+/*   from the standard input stream.                                          */
+/*                                                                            */
+/*   Reading past the '\n' of a buffered line sets line_overrun, since the    */
+/*   output of that line then depends on the next line.                       */
+/*                                                                            */
+/* Return: The character read as an unsigned char, or EOF.                    */
+/******************************************************************************/
+int readChar(void)
+{
+  if (line_position < line_length)
+  {
+    return (unsigned char) line_buffer[line_position++];
+  }
+  
+  if (line_length > 0 && !line_at_eof) line_overrun = 1;
+  
+  return getchar();
+}
+
+
+
+/******************************************************************************/
+/* writeOutput(const char * text)                                             */
+/*   Sends text to the standard output stream, and also appends it to         */
+/*   output_capture while the output of a line is being captured. If the      */
+/*   capture buffer is full, output_overflow is set instead.                  */
+/*                                                                            */
+/* Parameters: * text: A null-terminated string.                              */
+/******************************************************************************/
+void writeOutput(const char * text)
+{
+  fputs(text, stdout);
+  
+  if (output_capturing)
+  {
+    int length = strlen(text);
+    
+    if (output_length + length > (int) sizeof(output_capture))
+    {
+      output_overflow = 1;
+    }
+    else
+    {
+      memcpy(output_capture + output_length, text, length);
+      output_length += length;
+    }
+  }
+}
 
 
 
@@ -106,11 +442,9 @@ unsigned long long readNumber(char delimiter)
   int i = 0;
   int in_number = 0;
   
-  memset(digits, 0, strlen(digits));
-  
-  * (digits + strlen(digits)) = '\0';
+  memset(digits, 0, sizeof(digits));
   
-  while ((active_char = getchar()) != delimiter)
+  while ((active_char = readChar()) != delimiter)
   {
     if (i == 20) return 0;
     if (isdigit(active_char))
@@ -210,7 +544,7 @@ void skipToEndOfLine(void)
   
   while (state)
   {
-    active_char = getchar();
+    active_char = readChar();
     
     if (active_char == '\n')
     {
@@ -229,13 +563,15 @@ void skipToEndOfLine(void)
 
 /******************************************************************************/
 /* readDataBlock(char * data)                                                 */
-/*   Reads one block of data from the standard input stream.                  */
+/*   Reads one block of data from the standard input stream. The block size   */
+/*   is given by the global variable block_format.                            */
 /*   Reading stops when a full block is read or when '\n' is read.            */
 /*   An error is triggered if any byte code (other than '\n') is read         */
 /*   that is not a printable ASCII character: [32, 126].                      */
 /*                                                                            */
 /* Parameters:                                                                */
-/*   * data: A null-terminated array of size 5 into which the data is read.   */
+/*   * data: A null-terminated array of size MAX_BLOCK_CHARS + 1 into which   */
+/*     the data is read.                                                      */
 /*     All elements of data are initialized to '\0'.                          */
 /*     If global variable cipher_mode == 1, then each legal character read is */
 /*     copied into * data.                                                    */
@@ -243,7 +579,7 @@ void skipToEndOfLine(void)
 /*     and 127 might be represented as two-byte codes starting with '+'.      */
 /*     This function converts any such two-character codes to the single      */
 /*     ASCII code [0,127]. Therefore, this function may read as many as       */
-/*     eight characters form the standard input stream.                       */
+/*     twice the block size in characters form the standard input stream.     */
 /*                                                                            */
 /* Returns:                                                                   */
 /*   OK | END_OF_LINE | END_OF_FILE | ERROR                                   */
@@ -253,12 +589,12 @@ int readDataBlock(char * data)
   int i;
   
   //Clear the array
-  memset(data, 0, sizeof(char) * 5);
+  memset(data, 0, sizeof(char) * (MAX_BLOCK_CHARS + 1));
   
   //Populate the array from the standard input stream
-  for (i = 0; i < 4; i++)
+  for (i = 0; i < block_format->block_chars; i++)
   {
-    char active_char = getchar();
+    char active_char = readChar();
     
     if (active_char == '\n') return END_OF_LINE;
     else if (active_char == EOF) return END_OF_FILE;
@@ -284,6 +620,10 @@ int readDataBlock(char * data)
 /*   Sets the global variable cipher_mode to represent encryption or          */
 /*   decryption determined by the read character being 'e' or 'd'.            */
 /*                                                                            */
+/*   If the character is a format version digit, the global variable          */
+/*   block_format is set from it and the mode is read from the next           */
+/*   character. Otherwise block_format is set to the 28-bit format.           */
+/*                                                                            */
 /* Returns:                                                                   */
 /*   OK if an 'e' or 'd' was read.                                            */
 /*   END_OF_LINE if '\n' was read.                                            */
@@ -292,7 +632,24 @@ int readDataBlock(char * data)
 /******************************************************************************/
 int readCipherMode(void)
 {
-  char mode = getchar();
+  char mode = readChar();
+  
+  block_format = findBlockFormat('1');
+  
+  if (isdigit(mode))
+  {
+    block_format = findBlockFormat(mode);
+    if (block_format == NULL)
+    {
+      if (DEBUG_ERROR)
+      {
+        printf("Error: Invalid format version!\n");
+      }
+      block_format = findBlockFormat('1');
+      return ERROR;
+    }
+    mode = readChar();
+  }
   
   if (mode == 'e')
   {
@@ -350,6 +707,20 @@ int buildLCG(void)
     return ERROR;
   }
   
+  return initLCG();
+}
+
+
+
+/******************************************************************************/
+/* initLCG(void)                                                              */
+/*   Completes the linear congruental generator once the global variables     */
+/*   lcg_m and lcg_c are set, by calculating lcg_a and the seed lcg_x.        */
+/*                                                                            */
+/* Return: OK | ERROR                                                         */
+/******************************************************************************/
+int initLCG(void)
+{
   //Calculate LCG_A
   calculatePrimeFactors(lcg_m);
   
@@ -411,38 +782,163 @@ int buildLCG(void)
 
 /******************************************************************************/
 /* buildMap(void)                                                             */
-/*   Uses the global variables lcg_a, lcg_c, lcg_m and lcg_x to define the    */
-/*   global array builtMap such that builtMap[i] = k indicates that on        */
+/*   Builds the map for the next block using the map builder of the global    */
+/*   variable block_format.                                                   */
+/*                                                                            */
+/*   If the map cache is enabled, the first MAP_CACHE_BLOCKS maps of a line   */
+/*   are copied from the cache when an earlier line with the same key built   */
+/*   them, along with the LCG state following each map.                       */
+/******************************************************************************/
+void buildMap(void)
+{
+  int length = block_format->block_chars * 7;
+  int i;
+  
+  if (map_cache_enabled && map_block < map_cache_filled)
+  {
+    for (i = 0; i < length; i++)
+    {
+      builtMap[i] = map_cache[map_block][i];
+    }
+    lcg_x = map_cache_x[map_block];
+  }
+  else
+  {
+    block_format->buildMap();
+    
+    if (map_cache_enabled && map_block == map_cache_filled &&
+        map_block < MAP_CACHE_BLOCKS)
+    {
+      for (i = 0; i < length; i++)
+      {
+        map_cache[map_block][i] = builtMap[i];
+      }
+      map_cache_x[map_block] = lcg_x;
+      map_cache_filled++;
+    }
+  }
+  
+  map_block++;
+}
+
+
+
+/******************************************************************************/
+/* resetMapCache(void)                                                        */
+/*   Starts the map sequence of a new line. The map cache is emptied unless   */
+/*   the line uses the same key and format as the maps already in the cache.  */
+/******************************************************************************/
+void resetMapCache(void)
+{
+  map_block = 0;
+  
+  if (map_cache_format != block_format ||
+      map_cache_m != lcg_m || map_cache_c != lcg_c)
+  {
+    map_cache_format = block_format;
+    map_cache_m = lcg_m;
+    map_cache_c = lcg_c;
+    map_cache_filled = 0;
+  }
+}
+
+
+
+/******************************************************************************/
+/* byteCounts(unsigned long long word)                                        */
+/*   Counts the set bits in each byte of a word at once.                      */
+/*                                                                            */
+/* Return: A word whose byte k holds the number of bits set in byte k.        */
+/******************************************************************************/
+static inline unsigned long long byteCounts(unsigned long long word)
+{
+  word -= (word >> 1) & 0x5555555555555555ULL;
+  word = (word & 0x3333333333333333ULL) + ((word >> 2) & 0x3333333333333333ULL);
+  
+  return (word + (word >> 4)) & 0x0f0f0f0f0f0f0f0fULL;
+}
+
+
+
+/******************************************************************************/
+/* selectByte(unsigned long long sums, int rank)                              */
+/*   Finds the byte of a word holding its set bit of the given rank, without  */
+/*   looping over the bytes.                                                  */
+/*                                                                            */
+/* Parameters: sums: byteCounts of the word times BYTE_ONES, so that byte k   */
+/*                   holds the number of bits set in bytes 0 to k.            */
+/*             rank: The number of set bits before the one to find. Less than */
+/*                   the number of bits set in the word.                      */
+/*                                                                            */
+/* Return: The index of the byte, 0 to 7.                                     */
+/******************************************************************************/
+static inline int selectByte(unsigned long long sums, int rank)
+{
+  //The high bit of byte k ends up set when bytes 0 to k hold no more than
+  //rank set bits. Every byte of sums is at most 64 so nothing borrows.
+  unsigned long long below = (((rank * BYTE_ONES) | BYTE_HIGHS) - sums) &
+                             BYTE_HIGHS;
+  
+  return (int) (((below >> 7) * BYTE_ONES) >> 56);
+}
+
+
+
+/******************************************************************************/
+/* buildMapOfLength(int length, unsigned long long a, unsigned long long c,   */
+/*                  unsigned long long m)                                     */
+/*   Uses the LCG given by a, c and m and the global variable lcg_x to define */
+/*   the global array builtMap such that builtMap[i] = k indicates that on    */
 /*   encryption, bit i is moved to bit k and the reverse on decryption.       */
 /*                                                                            */
-/*   When this function returns, lcg_x will have been updated 28 steps        */
+/*   When this function returns, lcg_x will have been updated length steps    */
 /*   in the LCG.                                                              */
 /*                                                                            */
 /*   This method does not return a value because there is no reason for it    */
 /*   to fail.                                                                 */
+/*                                                                            */
+/*   Maps shorter than MAP_SELECT_LENGTH are placed by walking the free       */
+/*   spaces, O(length^2). Longer ones select each space from a bitmask of     */
+/*   the free spaces, popcounting at most length / 64 words per space.        */
+/*                                                                            */
+/* Parameters: length: The number of bits in a block. Always a constant so    */
+/*             that each block format gets its own specialized copy.          */
+/*             a, c, m: The LCG parameters. Either the global variables       */
+/*             lcg_a, lcg_c and lcg_m or, for a keyed build, constants.       */
 /******************************************************************************/
-void buildMap(void)
+static inline void buildMapOfLength(int length, unsigned long long a,
+                                    unsigned long long c, unsigned long long m)
 {
-  int g[MAP_LENGTH];
+  int g[MAX_MAP_LENGTH];
+  unsigned long long free_bits[MAP_WORDS];
+  int words = (length + 63) / 64;
   int i;
   
   //Clear map and associated fields.
-  memset(builtMap, 0, sizeof(int) * MAP_LENGTH);
-  memset(assigned, 0, sizeof(int) * MAP_LENGTH);
-  memset(assigned_index, 0, sizeof(int) * MAP_LENGTH);
+  memset(builtMap, 0, sizeof(int) * length);
+  memset(assigned, 0, sizeof(int) * length);
+  memset(assigned_index, 0, sizeof(int) * length);
+  
+  //Bit k of free_bits is set while space k is unassigned.
+  for (i = 0; i < words && length >= MAP_SELECT_LENGTH; i++)
+  {
+    int bits = length - 64 * i;
+    
+    free_bits[i] = bits >= 64 ? ~0ULL : (1ULL << bits) - 1;
+  }
   
   //Compute g(i)
-  for (i = 0; i < MAP_LENGTH; i++)
+  for (i = 0; i < length; i++)
   {
-    g[i] = lcg_x % (MAP_LENGTH - i);
-    lcg_x = ((lcg_a * lcg_x) + lcg_c) % lcg_m;
+    g[i] = lcg_x % (length - i);
+    lcg_x = ((a * lcg_x) + c) % m;
   }
   
   if (DEBUG_BUILDING_MAP)
   {
     printf("Building Map... g(i):\n");
     printf("%d", g[0]);
-    for (i = 1; i < MAP_LENGTH; i++)
+    for (i = 1; i < length; i++)
     {
       printf(", %d", g[i]);
     }
@@ -450,33 +946,55 @@ void buildMap(void)
   }
   
   //Compute f(i)
-  for (i = 0; i < MAP_LENGTH; i++)
+  for (i = 0; i < length; i++)
   {
     //Get the step size.
     int active_index = g[i];
     
-    //Traverse free spaces n times where n is equal to the step size.
     int index = 0;
-    int unassigned = 0;
     
-    while (unassigned != active_index)
+    if (length < MAP_SELECT_LENGTH)
     {
-      if (!assigned[index++]) unassigned++;
+      //Traverse free spaces n times where n is equal to the step size.
+      int unassigned = 0;
+      
+      while (unassigned != active_index)
+      {
+        if (!assigned[index++]) unassigned++;
+      }
+      
+      while (assigned[index]) index++;
     }
-    
-    int placed = 0;
-    
-    while (!placed)
+    else
     {
-      if (!assigned[index])
+      //Find the word holding the free space with active_index free spaces
+      //before it, then the byte and the bit within that word.
+      int remaining = active_index;
+      int word;
+      unsigned long long sums;
+      
+      for (word = 0; word < words - 1; word++)
       {
-        builtMap[i] = index;
-        assigned[index] = 1;
-        assigned_index[index] = i;
-        placed = 1;
+        sums = byteCounts(free_bits[word]) * BYTE_ONES;
+        if (remaining < (int) (sums >> 56)) break;
+        remaining -= sums >> 56;
       }
-      else index++;
+      
+      sums = byteCounts(free_bits[word]) * BYTE_ONES;
+      
+      int byte = selectByte(sums, remaining);
+      remaining -= ((sums << 8) >> (8 * byte)) & 0xff;
+      
+      unsigned int bits = (free_bits[word] >> (8 * byte)) & 0xff;
+      while (remaining--) bits &= bits - 1;
+      
+      index = 64 * word + 8 * byte + __builtin_ctz(bits);
+      free_bits[word] &= ~(1ULL << (index % 64));
     }
+    
+    builtMap[i] = index;
+    assigned[index] = 1;
+    assigned_index[index] = i;
  
     if (DEBUG_BUILDING_MAP)
     {
@@ -486,14 +1004,14 @@ void buildMap(void)
       printf("Step Size: g(%d) = %d\n", i, active_index);
       printf("Map\n");
       printf("%d", builtMap[0]);
-      for (j = 1; j < MAP_LENGTH; j++)
+      for (j = 1; j < length; j++)
       {
         printf(", %d", builtMap[j]);
       }
       printf("\n");
       printf("Assigned\n");
       printf("%d", assigned[0]);
-      for (j = 1; j < MAP_LENGTH; j++)
+      for (j = 1; j < length; j++)
       {
         printf(", %d", assigned[j]);
       }
@@ -501,7 +1019,7 @@ void buildMap(void)
       
       printf("Assigned Index\n");
       printf("%d", assigned_index[0]);
-      for (j = 1; j < MAP_LENGTH; j++)
+      for (j = 1; j < length; j++)
       {
         printf(", %d", assigned_index[j]);
       }
@@ -543,39 +1061,20 @@ void setBit(char * c, int n)
 
 
 /******************************************************************************/
-/* encryptText(char * data)                                                   */
-/*   Uses the global variable builtMap to encrypt the data block in * data.   */
-/*   The encrypted data is sent to the standard output stream.                */
-/*   The encrypted data will always be 4 to 8 bytes long.                     */
-/*   Encrypted byte codes [0,31], 127 and '+' are converted to 2-byte         */
-/*   printable ASCII characters.                                              */
+/* encryptBits(const char * data, char * encrypted, int length)               */
+/*   Permutation kernel. Uses the global variable builtMap to move each of    */
+/*   the length bits of the data block in * data to its place in * encrypted. */
 /*                                                                            */
-/* Parameters: * data: Must be a null terminated characater array of size 5.  */
-/*                                                                            */
-/* Return: OK | ERROR                                                         */
+/* Parameters: * data: The plain text block, 7 bits per character.            */
+/*             * encrypted: Cleared array receiving the permuted block.       */
+/*             length: The number of bits in a block. Always a constant so    */
+/*             that each block format gets its own specialized copy.          */
 /******************************************************************************/
-int encryptText(char * data)
+static inline void encryptBits(const char * data, char * encrypted, int length)
 {
-  char * encrypted = malloc(sizeof(char) * 5);
-  char * encrypted_formatted = malloc(sizeof(char) * 9);
-  
-  memset(encrypted, 0, sizeof(char) * 5);
-  memset(encrypted_formatted, 0, sizeof(char) * 9);
-  
   int i;
   
-  /* If the data is null, then skip encryption */
-  int empty_data_flag = 1;
-  
-  for (i = 0; i < 4; i++)
-  {
-    if (* (data + i)) empty_data_flag = 0;
-  }
-  
-  if (empty_data_flag) return OK;
-  /*********************************************/
-  
-  for (i = 0; i < 28; i++)
+  for (i = 0; i < length; i++)
   {
     if (0)
     {
@@ -595,98 +1094,444 @@ int encryptText(char * data)
       setBit(&encrypted[builtMap[i] / 7], builtMap[i] % 7);
     }
   }
-  
-  int counter = 0;
-  
-  for (i = 0; i < 4; i++)
-  {    
-    if (encrypted[i] < 32)
-    {
-      encrypted_formatted[counter++] = '+';
-      encrypted_formatted[counter++] = '@' + encrypted[i];
-    }
-    else if (encrypted[i] == 127)
-    {
-      encrypted_formatted[counter++] = '+';
-      encrypted_formatted[counter++] = '&';
-    }
-    else if (encrypted[i] == '+')
-    {
-      encrypted_formatted[counter++] = '+';
-      encrypted_formatted[counter++] = '+';
-    }
-    else
-    {
-      * (encrypted_formatted + counter++) = encrypted[i];
-    }
-  }
-  
-  if (DEBUG_ENCRYPT)
-  {
-    printf("\nPartially Encrypted ASCII: %d, %d, %d, %d\n",
-           encrypted[0], encrypted[1], encrypted[2], encrypted[3]);
-    
-    printf("The Partially Encrypted Text: %s\n", encrypted);
-    
-    printf("\nCipher Text ASCII: %d, %d, %d, %d\n",
-           encrypted_formatted[0], encrypted_formatted[1],
-           encrypted_formatted[2], encrypted_formatted[3]);
-    
-    printf("The Cipher Text: %s\n", encrypted_formatted);
-  }
-  
-  if (!DEBUG_ENCRYPT) printf("%s", encrypted_formatted);
-  
-  free(encrypted);
-  free(encrypted_formatted);
-  
-  return OK;
 }
 
 
 
 /******************************************************************************/
-/* decrypt(char * data)                                                       */
-/*   Uses the global variable builtMap to decrypt the data block in * data.   */
-/*   The decrypted data is sent to the standard output stream.                */
-/*   The decrypted data will always be 1 to 4 bytes long.                     */
-/*   If a decrypted character is '\0' it means that the data block was a      */
-/*   parcial block from the end of the line. '\0' characters are not printed. */
-/*   Any other decrypted byte that is not a printable ASCII character is an   */
-/*   error.                                                                   */
-/*                                                                            */
-/* Parameters: * data: Must be a null terminated character array of size 5.   */
+/* decryptBits(const char * decrypted, char * data, int length)               */
+/*   Permutation kernel. Uses the global variable builtMap to move each of    */
+/*   the length bits of the block in * decrypted back to its place in * data. */
 /*                                                                            */
-/* Return: OK | ERROR                                                         */
+/* Parameters: * decrypted: The unescaped cipher text block.                  */
+/*             * data: Cleared array receiving the plain text block.          */
+/*             length: The number of bits in a block. Always a constant so    */
+/*             that each block format gets its own specialized copy.          */
 /******************************************************************************/
-int decryptText(char * data)
+static inline void decryptBits(const char * decrypted, char * data, int length)
 {
-  char * decrypted = malloc(sizeof(char) * 9);
-  char * decrypted_formatted = malloc(sizeof(char) * 5);
-  
-  memset(decrypted, 0, sizeof(char) * 5);
-  memset(decrypted_formatted, 0, sizeof(char) * 5);
-  
   int i;
   
-  /* If the data is null, then skip decryption */
-  int empty_data_flag = 1;
-  
-  for (i = 0; i < 4; i++)
-  {
-    if (* (data + i)) empty_data_flag = 0;
-  }
-  
-  if (empty_data_flag) return OK;
-  /*********************************************/
-  
-  for (i = 0; i < 4; i++)
+  for (i = 0; i < length; i++)
   {
-    if (data[i] == '+')
+    if (0)
     {
-      if (i < 3)
-      {
-        if (data[i + 1] == '+')
+      printf("The builtMap[%d] = %d\n", i, builtMap[i]);
+      printf("Is bit %d (%d mod 7 = %d) in decrypted[%d (%d / 7 = %d)] on? ––– %d\n",
+             builtMap[i] % 7, builtMap[i], builtMap[i] % 7, builtMap[i] / 7,
+             builtMap[i], builtMap[i] / 7,
+             isBitSet(decrypted[builtMap[i] / 7], builtMap[i] % 7));
+    }
+    
+    if (isBitSet(decrypted[builtMap[i] / 7], builtMap[i] % 7))
+    {
+      if (DEBUG_BUILT_MAP)
+      {
+        printf("Placing bit at index %d on decrypted_formatted[%d]\n", i % 7, i / 7);
+        printf("(%d, %d) --> (%d, %d)\n\n", builtMap[i] % 7, builtMap[i] / 7, i % 7, i / 7);
+      }
+      setBit(&data[i / 7], i % 7);
+    }
+  }
+}
+
+
+
+/******************************************************************************/
+/* DEFINE_BLOCK_FORMAT(BITS)                                                  */
+/*   Defines buildMapBITS, encryptBitsBITS and decryptBitsBITS, the map       */
+/*   builder and permutation kernels for blocks of BITS bits. Passing BITS as */
+/*   a constant lets the compiler unroll the loops and replace the divisions  */
+/*   by 7 and by (length - i) for each width.                                 */
+/******************************************************************************/
+#define DEFINE_BLOCK_FORMAT(BITS)                                              \
+void buildMap##BITS(void)                                                      \
+{                                                                              \
+  buildMapOfLength(BITS, lcg_a, lcg_c, lcg_m);                                 \
+}                                                                              \
+                                                                               \
+void encryptBits##BITS(const char * data, char * encrypted)                    \
+{                                                                              \
+  encryptBits(data, encrypted, BITS);                                          \
+}                                                                              \
+                                                                               \
+void decryptBits##BITS(const char * decrypted, char * data)                    \
+{                                                                              \
+  decryptBits(decrypted, data, BITS);                                          \
+}
+
+DEFINE_BLOCK_FORMAT(28)
+DEFINE_BLOCK_FORMAT(56)
+DEFINE_BLOCK_FORMAT(112)
+DEFINE_BLOCK_FORMAT(224)
+
+//The supported formats. Version '1' is the original 28-bit format.
+static const struct blockFormat block_formats[] =
+{
+  {'1', 4, buildMap28, encryptBits28, decryptBits28},
+  {'2', 8, buildMap56, encryptBits56, decryptBits56},
+  {'3', 16, buildMap112, encryptBits112, decryptBits112},
+  {'4', 32, buildMap224, encryptBits224, decryptBits224}
+};
+
+
+
+/******************************************************************************/
+/* findBlockFormat(char version)                                              */
+/*   Looks up a block format by its version character.                        */
+/*                                                                            */
+/* Return: The matching format or NULL if the version is unknown.             */
+/******************************************************************************/
+const struct blockFormat * findBlockFormat(char version)
+{
+  int count = sizeof(block_formats) / sizeof(block_formats[0]);
+  int i;
+  
+  for (i = 0; i < count; i++)
+  {
+    if (block_formats[i].version == version) return &block_formats[i];
+  }
+  
+  return NULL;
+}
+
+
+#ifdef KEYED
+/******************************************************************************/
+/* buildMapKeyed(void)                                                        */
+/*   Map builder for lines using the key baked in from keyed.h. Copies the    */
+/*   map of the current block from keyed_maps if keygen found the map period, */
+/*   otherwise builds the map with the LCG parameters as constants.           */
+/******************************************************************************/
+void buildMapKeyed(void)
+{
+#if KEYED_MAP_PERIOD > 0
+  int i;
+  
+  for (i = 0; i < MAP_LENGTH; i++)
+  {
+    builtMap[i] = keyed_maps[map_block % KEYED_MAP_PERIOD][i];
+  }
+#else
+  buildMapOfLength(MAP_LENGTH, KEYED_LCG_A, KEYED_LCG_C, KEYED_LCG_M);
+#endif
+}
+
+static const struct blockFormat keyed_block_format =
+{
+  '1', 4, buildMapKeyed, encryptBits28, decryptBits28
+};
+
+
+
+/******************************************************************************/
+/* selectKeyedFormat(void)                                                    */
+/*   Switches the global variable block_format to the keyed map builder if    */
+/*   the line is in the 28-bit format and uses the key baked in from keyed.h. */
+/******************************************************************************/
+void selectKeyedFormat(void)
+{
+  if (block_format->version == '1' &&
+      lcg_m == KEYED_LCG_M && lcg_c == KEYED_LCG_C)
+  {
+    block_format = &keyed_block_format;
+  }
+}
+#endif
+
+
+
+/******************************************************************************/
+/* writeKeyedSource(const char * key)                                         */
+/*   Prints a C header specializing the program for one key in the 28-bit     */
+/*   format to the standard output stream. It defines KEYED_LCG_M,            */
+/*   KEYED_LCG_C and KEYED_LCG_A and, if the map sequence of the key repeats  */
+/*   within KEYGEN_MAX_PERIOD blocks, the table keyed_maps holding one period */
+/*   of maps. KEYED_MAP_PERIOD is the number of maps in the table, or 0 if    */
+/*   the maps must be built at run time.                                      */
+/*                                                                            */
+/*   The map sequence repeats once lcg_x returns to its seed at the start of  */
+/*   a block, because each map only depends on lcg_x at the start of its      */
+/*   block.                                                                   */
+/*                                                                            */
+/* Parameters: * key: The key as "M,C", as it appears in an input line.       */
+/*                                                                            */
+/* Return: EXIT_SUCCESS | EXIT_FAILURE                                        */
+/******************************************************************************/
+int writeKeyedSource(const char * key)
+{
+  char extra;
+  int period;
+  int i;
+  int j;
+  
+  if (sscanf(key, "%llu,%llu%c", &lcg_m, &lcg_c, &extra) != 2 ||
+      lcg_m == 0 || lcg_c == 0 || initLCG() != OK)
+  {
+    fprintf(stderr, "Error: Invalid key %s\n", key);
+    return EXIT_FAILURE;
+  }
+  
+  block_format = findBlockFormat('1');
+  
+  for (period = 1; period <= KEYGEN_MAX_PERIOD; period++)
+  {
+    buildMap();
+    if (lcg_x == lcg_c) break;
+  }
+  
+  if (period > KEYGEN_MAX_PERIOD) period = 0;
+  
+  printf("/* Generated by \"cipher keygen %s\". Do not edit. */\n", key);
+  printf("#define KEYED_LCG_M %lluULL\n", lcg_m);
+  printf("#define KEYED_LCG_C %lluULL\n", lcg_c);
+  printf("#define KEYED_LCG_A %lluULL\n", lcg_a);
+  printf("#define KEYED_MAP_PERIOD %d\n", period);
+  
+  if (period == 0) return EXIT_SUCCESS;
+  
+  lcg_x = lcg_c;
+  
+  printf("\nstatic const unsigned char ");
+  printf("keyed_maps[KEYED_MAP_PERIOD][MAP_LENGTH] =\n");
+  printf("{\n");
+  
+  for (i = 0; i < period; i++)
+  {
+    buildMap();
+    
+    printf("  {");
+    for (j = 0; j < MAP_LENGTH; j++)
+    {
+      if (j == MAP_LENGTH / 2) printf(",\n   ");
+      else if (j > 0) printf(", ");
+      printf("%2d", builtMap[j]);
+    }
+    printf("}%s\n", i < period - 1 ? "," : "");
+  }
+  
+  printf("};\n");
+  
+  return EXIT_SUCCESS;
+}
+
+
+
+/******************************************************************************/
+/* encryptBlock(const char * data, char * encrypted_formatted)                */
+/*   Uses the global variable builtMap to encrypt the data block in * data    */
+/*   into printable cipher text in * encrypted_formatted.                     */
+/*   The encrypted data will always be 1 to 2 bytes per character of the      */
+/*   block, 4 to 8 bytes for the 28-bit format.                               */
+/*   Encrypted byte codes [0,31], 127 and '+' are converted to 2-byte         */
+/*   printable ASCII characters.                                              */
+/*                                                                            */
+/* Parameters: * data: Must be a null terminated characater array of size     */
+/*                     MAX_BLOCK_CHARS + 1.                                   */
+/*             * encrypted_formatted: Array of size 2 * MAX_BLOCK_CHARS + 1   */
+/*                     receiving the null terminated cipher text.             */
+/*                                                                            */
+/* Return: The length of the cipher text, 0 if the data block is empty.       */
+/******************************************************************************/
+int encryptBlock(const char * data, char * encrypted_formatted)
+{
+  char encrypted[MAX_BLOCK_CHARS + 1];
+  int block_chars = block_format->block_chars;
+  
+  memset(encrypted, 0, sizeof(encrypted));
+  memset(encrypted_formatted, 0, sizeof(char) * (2 * MAX_BLOCK_CHARS + 1));
+  
+  int i;
+  
+  /* If the data is null, then skip encryption */
+  int empty_data_flag = 1;
+  
+  for (i = 0; i < block_chars; i++)
+  {
+    if (* (data + i)) empty_data_flag = 0;
+  }
+  
+  if (empty_data_flag) return 0;
+  /*********************************************/
+  
+  block_format->encryptBits(data, encrypted);
+  
+  int counter = 0;
+  
+  for (i = 0; i < block_chars; i++)
+  {    
+    if (encrypted[i] < 32)
+    {
+      encrypted_formatted[counter++] = '+';
+      encrypted_formatted[counter++] = '@' + encrypted[i];
+    }
+    else if (encrypted[i] == 127)
+    {
+      encrypted_formatted[counter++] = '+';
+      encrypted_formatted[counter++] = '&';
+    }
+    else if (encrypted[i] == '+')
+    {
+      encrypted_formatted[counter++] = '+';
+      encrypted_formatted[counter++] = '+';
+    }
+    else
+    {
+      * (encrypted_formatted + counter++) = encrypted[i];
+    }
+  }
+  
+  if (DEBUG_ENCRYPT)
+  {
+    printf("\nPartially Encrypted ASCII: %d, %d, %d, %d\n",
+           encrypted[0], encrypted[1], encrypted[2], encrypted[3]);
+    
+    printf("The Partially Encrypted Text: %s\n", encrypted);
+    
+    printf("\nCipher Text ASCII: %d, %d, %d, %d\n",
+           encrypted_formatted[0], encrypted_formatted[1],
+           encrypted_formatted[2], encrypted_formatted[3]);
+    
+    printf("The Cipher Text: %s\n", encrypted_formatted);
+  }
+  
+  return counter;
+}
+
+
+
+/******************************************************************************/
+/* encryptText(char * data)                                                   */
+/*   Encrypts the data block in * data with encryptBlock and sends the        */
+/*   cipher text to the standard output stream.                               */
+/*                                                                            */
+/* Parameters: * data: Must be a null terminated characater array of size     */
+/*                     MAX_BLOCK_CHARS + 1.                                   */
+/*                                                                            */
+/* Return: OK | ERROR                                                         */
+/******************************************************************************/
+int encryptText(char * data)
+{
+  char encrypted_formatted[2 * MAX_BLOCK_CHARS + 1];
+  int counter;
+  
+  counter = encryptBlock(data, encrypted_formatted);
+  if (counter == 0) return OK;
+  
+  if (index_entry_open && map_block > 1 && (map_block - 1) % index_every == 0)
+  {
+    fprintf(index_out, " %llu", cipher_offset);
+  }
+  
+  if (!DEBUG_ENCRYPT) writeOutput(encrypted_formatted);
+  
+  cipher_offset += counter;
+  
+  return OK;
+}
+
+
+
+/******************************************************************************/
+/* decryptBlock(const char * decrypted, char * decrypted_formatted)           */
+/*   Uses the global variable builtMap to decrypt the block in * decrypted,   */
+/*   whose two-byte codes are already converted back to single bytes, into    */
+/*   * decrypted_formatted.                                                   */
+/*   If a decrypted character is '\0' it means that the data block was a      */
+/*   parcial block from the end of the line.                                  */
+/*   Any other decrypted byte that is not a printable ASCII character is an   */
+/*   error.                                                                   */
+/*                                                                            */
+/* Parameters: * decrypted: Array of size MAX_BLOCK_CHARS + 1.                */
+/*             * decrypted_formatted: Cleared array of size                   */
+/*                     MAX_BLOCK_CHARS + 1 receiving the plain text.          */
+/*                                                                            */
+/* Return: OK | ERROR                                                         */
+/******************************************************************************/
+int decryptBlock(const char * decrypted, char * decrypted_formatted)
+{
+  int block_chars = block_format->block_chars;
+  int i;
+  
+  block_format->decryptBits(decrypted, decrypted_formatted);
+  
+  if (DEBUG_DECRYPT)
+  {
+    printf("Partially Decrypted ASCII: %d, %d, %d, %d\n",
+           decrypted[0], decrypted[1], decrypted[2], decrypted[3]);
+    
+    printf("The Partially Decrypted Text: %s\n", decrypted);
+    
+    printf("\nPlain Text ASCII: %d, %d, %d, %d\n",
+           decrypted_formatted[0], decrypted_formatted[1],
+           decrypted_formatted[2], decrypted_formatted[3]);
+    
+    printf("The Plain Text: %s\n", decrypted_formatted);
+  }
+  
+  for (i = 0; i < block_chars; i++)
+  {
+    if ((decrypted_formatted[i] > 0 && decrypted_formatted[i] < 32) ||
+        decrypted_formatted[i] == 127)
+    {
+      if (DEBUG_ERROR)
+      {
+        printf("Decrypted decrypted_formatted[%d] is out of ASCII range: %d\n",
+               i, decrypted_formatted[i]);
+      }
+      return ERROR;
+    }
+  }
+  
+  return OK;
+}
+
+
+
+/******************************************************************************/
+/* decrypt(char * data)                                                       */
+/*   Converts the two-byte codes of the data block in * data back to single   */
+/*   bytes, reading more characters from the input if needed, decrypts it     */
+/*   with decryptBlock and sends the plain text to the standard output        */
+/*   stream.                                                                  */
+/*   The decrypted data will always be 1 to block size bytes long.            */
+/*   '\0' characters are not printed. With --range, only the characters       */
+/*   inside the range are sent.                                               */
+/*                                                                            */
+/* Parameters: * data: Must be a null terminated character array of size      */
+/*                     MAX_BLOCK_CHARS + 1.                                   */
+/*                                                                            */
+/* Return: OK | ERROR                                                         */
+/******************************************************************************/
+int decryptText(char * data)
+{
+  char decrypted[MAX_BLOCK_CHARS + 1];
+  char decrypted_formatted[MAX_BLOCK_CHARS + 1];
+  int block_chars = block_format->block_chars;
+  
+  memset(decrypted, 0, sizeof(decrypted));
+  memset(decrypted_formatted, 0, sizeof(decrypted_formatted));
+  
+  int i;
+  
+  /* If the data is null, then skip decryption */
+  int empty_data_flag = 1;
+  
+  for (i = 0; i < block_chars; i++)
+  {
+    if (* (data + i)) empty_data_flag = 0;
+  }
+  
+  if (empty_data_flag) return OK;
+  /*********************************************/
+  
+  for (i = 0; i < block_chars; i++)
+  {
+    if (data[i] == '+')
+    {
+      if (i < block_chars - 1)
+      {
+        if (data[i + 1] == '+')
         {
           decrypted[i] = '+';
         }
@@ -701,16 +1546,16 @@ int decryptText(char * data)
         
         int j;
         
-        for (j = i + 1; j < 4; j++)
+        for (j = i + 1; j < block_chars; j++)
         {
           data[j] = data[j + 1];
         }
         
-        data[3] = getchar();
+        data[block_chars - 1] = readChar();
       }
       else
       {
-        char last = getchar();
+        char last = readChar();
         
         if (last == '+')
         {
@@ -729,80 +1574,1345 @@ int decryptText(char * data)
     else decrypted[i] = data[i];
   }
   
-  for (i = 0; i < 28; i++)
+  if (decryptBlock(decrypted, decrypted_formatted) == ERROR) return ERROR;
+  
+  //Only print the part of the block inside the range.
+  if (range_enabled)
+  {
+    long long start = (long long) (map_block - 1) * block_chars;
+    long long length = strlen(decrypted_formatted);
+    long long from = range_first > start ? range_first - start : 0;
+    long long to = range_last - start + 1;
+    
+    if (to > length) to = length;
+    if (from >= to) return OK;
+    
+    decrypted_formatted[to] = '\0';
+    if (!DEBUG_DECRYPT) writeOutput(decrypted_formatted + from);
+    
+    return OK;
+  }
+  
+  if (!DEBUG_DECRYPT) writeOutput(decrypted_formatted);
+  
+  return OK;
+}
+
+
+
+/******************************************************************************/
+/* elapsedNanoseconds(const struct timespec * start)                          */
+/*   Measures the time passed since start on the monotonic clock.             */
+/*                                                                            */
+/* Parameters: * start: A time previously read from CLOCK_MONOTONIC.          */
+/*                                                                            */
+/* Return: The number of nanoseconds elapsed since start.                     */
+/******************************************************************************/
+unsigned long long elapsedNanoseconds(const struct timespec * start)
+{
+  struct timespec now;
+  
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  
+  return (unsigned long long) (now.tv_sec - start->tv_sec) * 1000000000ULL +
+         now.tv_nsec - start->tv_nsec;
+}
+
+
+
+/******************************************************************************/
+/* recordLatency(unsigned long long nanoseconds)                              */
+/*   Adds one sample to the global latency histogram.                         */
+/*                                                                            */
+/*   Samples are shifted right until they fit in the sub bucket range; the    */
+/*   number of shifts selects the bucket. This keeps the relative error of    */
+/*   every recorded value below 1 / 2^(HISTOGRAM_SUB_BITS - 1) while using a  */
+/*   fixed amount of memory.                                                  */
+/*                                                                            */
+/* Parameters: nanoseconds: The latency of one line.                          */
+/******************************************************************************/
+void recordLatency(unsigned long long nanoseconds)
+{
+  unsigned long long sub = nanoseconds;
+  int bucket = 0;
+  
+  while (sub >= (1 << HISTOGRAM_SUB_BITS) && bucket < HISTOGRAM_BUCKETS - 1)
+  {
+    sub >>= 1;
+    bucket++;
+  }
+  
+  //Clamp samples beyond the range of the histogram into the last slot.
+  if (sub >= (1 << HISTOGRAM_SUB_BITS)) sub = (1 << HISTOGRAM_SUB_BITS) - 1;
+  
+  latency_counts[bucket][sub]++;
+  latency_total++;
+  if (nanoseconds > latency_max) latency_max = nanoseconds;
+}
+
+
+
+/******************************************************************************/
+/* latencyPercentile(double percentile)                                       */
+/*   Finds the smallest recorded value such that the given percentage of all  */
+/*   samples are less than or equal to it.                                    */
+/*                                                                            */
+/* Parameters: percentile: The percentile to look up, in the range (0, 100].  */
+/*                                                                            */
+/* Return: The upper bound of the histogram slot holding the percentile, or   */
+/*         0 if no samples were recorded.                                     */
+/******************************************************************************/
+unsigned long long latencyPercentile(double percentile)
+{
+  unsigned long long target;
+  unsigned long long seen = 0;
+  int bucket;
+  int sub;
+  
+  if (latency_total == 0) return 0;
+  
+  target = (unsigned long long) (percentile / 100.0 * latency_total + 0.999999);
+  if (target < 1) target = 1;
+  if (target > latency_total) target = latency_total;
+  
+  for (bucket = 0; bucket < HISTOGRAM_BUCKETS; bucket++)
+  {
+    for (sub = 0; sub < (1 << HISTOGRAM_SUB_BITS); sub++)
+    {
+      seen += latency_counts[bucket][sub];
+      
+      if (seen >= target)
+      {
+        unsigned long long value = (((unsigned long long) sub + 1) << bucket) - 1;
+        
+        return value < latency_max ? value : latency_max;
+      }
+    }
+  }
+  
+  return latency_max;
+}
+
+
+
+/******************************************************************************/
+/* printLatencyHistogram(void)                                                */
+/*   Prints every non-empty slot of the latency histogram with its count and  */
+/*   cumulative percentage, followed by a percentile summary, to the standard */
+/*   error stream so it does not mix with the cipher output.                  */
+/******************************************************************************/
+void printLatencyHistogram(void)
+{
+  unsigned long long seen = 0;
+  int bucket;
+  int sub;
+  
+  fprintf(stderr, "%20s %12s %10s\n", "Latency (ns)", "Count", "Percentile");
+  
+  for (bucket = 0; bucket < HISTOGRAM_BUCKETS; bucket++)
+  {
+    for (sub = 0; sub < (1 << HISTOGRAM_SUB_BITS); sub++)
+    {
+      unsigned long long count = latency_counts[bucket][sub];
+      
+      if (count == 0) continue;
+      
+      seen += count;
+      fprintf(stderr, "%20llu %12llu %9.4f%%\n",
+              (((unsigned long long) sub + 1) << bucket) - 1, count,
+              100.0 * seen / latency_total);
+    }
+  }
+  
+  fprintf(stderr, "Lines: %llu p50: %llu p99: %llu p999: %llu max: %llu\n",
+          latency_total, latencyPercentile(50.0), latencyPercentile(99.0),
+          latencyPercentile(99.9), latency_max);
+}
+
+
+
+/******************************************************************************/
+/* profilePath(void)                                                          */
+/*   Names the file holding the tuning profile.                               */
+/*                                                                            */
+/* Return: The value of the environment variable CIPHER_PROFILE if set,       */
+/*         otherwise ".cipher_profile".                                       */
+/******************************************************************************/
+const char * profilePath(void)
+{
+  const char * path = getenv("CIPHER_PROFILE");
+  
+  return path != NULL ? path : ".cipher_profile";
+}
+
+
+
+/******************************************************************************/
+/* loadProfile(void)                                                          */
+/*   Sets the tuning globals map_cache_enabled and output_buffer_size from    */
+/*   the profile file, which holds one "name value" pair per line. A missing  */
+/*   profile file leaves the defaults in place.                               */
+/*                                                                            */
+/* Return: OK | ERROR                                                         */
+/******************************************************************************/
+int loadProfile(void)
+{
+  FILE * file = fopen(profilePath(), "r");
+  char name[32];
+  int value;
+  int result = OK;
+  
+  if (file == NULL) return OK;
+  
+  while (result == OK && fscanf(file, "%31s %d", name, &value) == 2)
+  {
+    if (!strcmp(name, "map_cache"))
+    {
+      map_cache_enabled = value != 0;
+    }
+    else if (!strcmp(name, "output_buffer") &&
+             value >= 0 && value <= MAX_OUTPUT_BUFFER)
+    {
+      output_buffer_size = value;
+    }
+    else result = ERROR;
+  }
+  
+  if (result == OK && !feof(file)) result = ERROR;
+  
+  if (result == ERROR)
+  {
+    fprintf(stderr, "Error: Invalid profile %s\n", profilePath());
+  }
+  
+  fclose(file);
+  
+  return result;
+}
+
+
+
+/******************************************************************************/
+/* saveProfile(void)                                                          */
+/*   Writes the tuning globals map_cache_enabled and output_buffer_size to    */
+/*   the profile file in the format read by loadProfile.                      */
+/*                                                                            */
+/* Return: OK | ERROR                                                         */
+/******************************************************************************/
+int saveProfile(void)
+{
+  FILE * file = fopen(profilePath(), "w");
+  
+  if (file == NULL)
+  {
+    fprintf(stderr, "Error: Cannot write profile %s\n", profilePath());
+    return ERROR;
+  }
+  
+  fprintf(file, "map_cache %d\n", map_cache_enabled);
+  fprintf(file, "output_buffer %d\n", output_buffer_size);
+  
+  if (fclose(file) != 0)
+  {
+    fprintf(stderr, "Error: Cannot write profile %s\n", profilePath());
+    return ERROR;
+  }
+  
+  return OK;
+}
+
+
+
+/******************************************************************************/
+/* autotune(const char * sample)                                              */
+/*   Ciphers the lines of the file sample with every combination of map cache */
+/*   on or off and stdout buffer size, discarding the output, and saves the   */
+/*   fastest combination as the profile. Each combination is run              */
+/*   AUTOTUNE_ROUNDS times and its fastest run is used. The timings are       */
+/*   reported to the standard error stream.                                   */
+/*                                                                            */
+/*   The sample should be a representative slice of the real input, since     */
+/*   the best profile depends on the line lengths and how often keys repeat.  */
+/*                                                                            */
+/* Parameters: * sample: Path of the file to tune on.                         */
+/*                                                                            */
+/* Return: EXIT_SUCCESS | EXIT_FAILURE                                        */
+/******************************************************************************/
+int autotune(const char * sample)
+{
+  static const int buffer_sizes[] = {0, 65536, MAX_OUTPUT_BUFFER};
+  int buffer_count = sizeof(buffer_sizes) / sizeof(buffer_sizes[0]);
+  unsigned long long best_time = 0;
+  int best_cache = 0;
+  int best_buffer = 0;
+  int cache;
+  int buffer;
+  int round;
+  
+  for (cache = 0; cache <= 1; cache++)
+  {
+    for (buffer = 0; buffer < buffer_count; buffer++)
+    {
+      unsigned long long time = 0;
+      
+      for (round = 0; round < AUTOTUNE_ROUNDS; round++)
+      {
+        struct timespec start;
+        unsigned long long elapsed;
+        
+        if (freopen(sample, "r", stdin) == NULL)
+        {
+          fprintf(stderr, "Error: Cannot read sample %s\n", sample);
+          return EXIT_FAILURE;
+        }
+        if (freopen("/dev/null", "w", stdout) == NULL)
+        {
+          fprintf(stderr, "Error: Cannot open /dev/null\n");
+          return EXIT_FAILURE;
+        }
+        if (buffer_sizes[buffer] > 0)
+        {
+          setvbuf(stdout, stdout_buffer, _IOFBF, buffer_sizes[buffer]);
+        }
+        
+        map_cache_enabled = cache;
+        map_cache_format = NULL;
+        
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        cipherLines();
+        fflush(stdout);
+        elapsed = elapsedNanoseconds(&start);
+        
+        if (round == 0 || elapsed < time) time = elapsed;
+      }
+      
+      fprintf(stderr, "map_cache %d output_buffer %7d: %llu ns\n",
+              cache, buffer_sizes[buffer], time);
+      
+      if (best_time == 0 || time < best_time)
+      {
+        best_time = time;
+        best_cache = cache;
+        best_buffer = buffer_sizes[buffer];
+      }
+    }
+  }
+  
+  map_cache_enabled = best_cache;
+  output_buffer_size = best_buffer;
+  
+  if (saveProfile() == ERROR) return EXIT_FAILURE;
+  
+  fprintf(stderr, "Saved map_cache %d output_buffer %d to %s\n",
+          map_cache_enabled, output_buffer_size, profilePath());
+  
+  return EXIT_SUCCESS;
+}
+
+
+
+/******************************************************************************/
+/* bufferLine(void)                                                           */
+/*   Reads the next line, including its '\n', from the standard input stream  */
+/*   into line_buffer. Reading stops early once RESULT_CACHE_MAX_LINE         */
+/*   characters are buffered.                                                 */
+/*                                                                            */
+/*   Sets line_complete if the whole line fit, and line_at_eof if the line    */
+/*   was ended by EOF rather than '\n'.                                       */
+/******************************************************************************/
+void bufferLine(void)
+{
+  int active_char = 0;
+  
+  line_length = 0;
+  line_position = 0;
+  line_at_eof = 0;
+  line_overrun = 0;
+  
+  while (line_length < RESULT_CACHE_MAX_LINE && active_char != '\n')
+  {
+    active_char = getchar();
+    
+    if (active_char == EOF)
+    {
+      line_at_eof = 1;
+      break;
+    }
+    
+    line_buffer[line_length++] = active_char;
+  }
+  
+  line_complete = line_length > 0 && (line_at_eof || active_char == '\n');
+}
+
+
+
+/******************************************************************************/
+/* hashLine(void)                                                             */
+/*   Hashes the buffered line with 64-bit FNV-1a. The line holds the format,  */
+/*   mode, key and payload, so equal hashes are only worth comparing in full. */
+/*                                                                            */
+/* Return: The hash of line_buffer.                                           */
+/******************************************************************************/
+unsigned long long hashLine(void)
+{
+  unsigned long long hash = 14695981039346656037ULL;
+  int i;
+  
+  for (i = 0; i < line_length; i++)
+  {
+    hash ^= (unsigned char) line_buffer[i];
+    hash *= 1099511628211ULL;
+  }
+  
+  return hash;
+}
+
+
+
+/******************************************************************************/
+/* initResultCache(void)                                                      */
+/*   Allocates the result cache as a table of RESULT_CACHE_WAYS-entry buckets */
+/*   holding at least result_cache_entries entries. The number of buckets is  */
+/*   a power of two so a hash picks its bucket with a mask.                   */
+/*                                                                            */
+/* Return: OK | ERROR                                                         */
+/******************************************************************************/
+int initResultCache(void)
+{
+  result_cache_buckets = 1;
+  
+  while (result_cache_buckets * RESULT_CACHE_WAYS < result_cache_entries)
+  {
+    result_cache_buckets *= 2;
+  }
+  
+  result_cache = calloc(result_cache_buckets * RESULT_CACHE_WAYS,
+                        sizeof(struct cachedResult));
+  
+  if (result_cache == NULL)
+  {
+    fprintf(stderr, "Error: Cannot allocate the result cache\n");
+    return ERROR;
+  }
+  
+  return OK;
+}
+
+
+
+/******************************************************************************/
+/* findResult(unsigned long long hash)                                        */
+/*   Looks up the buffered line in the result cache.                          */
+/*                                                                            */
+/* Parameters: hash: The hash of the buffered line, from hashLine.            */
+/*                                                                            */
+/* Return: The entry holding the line, or NULL if it is not cached.           */
+/******************************************************************************/
+struct cachedResult * findResult(unsigned long long hash)
+{
+  struct cachedResult * bucket;
+  int i;
+  
+  bucket = result_cache +
+           (hash & (result_cache_buckets - 1)) * RESULT_CACHE_WAYS;
+  
+  result_cache_lookups++;
+  
+  for (i = 0; i < RESULT_CACHE_WAYS; i++)
+  {
+    if (bucket[i].text != NULL && bucket[i].hash == hash &&
+        bucket[i].line_length == line_length &&
+        !memcmp(bucket[i].text, line_buffer, line_length))
+    {
+      bucket[i].referenced = 1;
+      result_cache_hits++;
+      return &bucket[i];
+    }
+  }
+  
+  return NULL;
+}
+
+
+
+/******************************************************************************/
+/* evictResult(struct cachedResult * entry)                                   */
+/*   Frees an entry of the result cache, leaving it empty.                    */
+/******************************************************************************/
+void evictResult(struct cachedResult * entry)
+{
+  result_cache_used -= entry->line_length + entry->output_length;
+  result_cache_evictions++;
+  
+  free(entry->text);
+  memset(entry, 0, sizeof(struct cachedResult));
+}
+
+
+
+/******************************************************************************/
+/* storeResult(unsigned long long hash)                                       */
+/*   Adds the buffered line and its captured output to the result cache.      */
+/*                                                                            */
+/*   If the bucket of the line is full, an entry that was not hit since it    */
+/*   was stored is replaced, or the first entry if all were hit. If the cache */
+/*   then exceeds result_cache_bytes, a clock hand sweeps over the whole      */
+/*   table evicting entries that were not hit since the hand last passed.     */
+/*                                                                            */
+/* Parameters: hash: The hash of the buffered line, from hashLine.            */
+/******************************************************************************/
+void storeResult(unsigned long long hash)
+{
+  unsigned long long size = line_length + output_length;
+  unsigned long long slots = result_cache_buckets * RESULT_CACHE_WAYS;
+  struct cachedResult * bucket;
+  struct cachedResult * entry = NULL;
+  int i;
+  
+  if (size > result_cache_bytes) return;
+  
+  bucket = result_cache +
+           (hash & (result_cache_buckets - 1)) * RESULT_CACHE_WAYS;
+  
+  for (i = 0; i < RESULT_CACHE_WAYS && entry == NULL; i++)
+  {
+    if (bucket[i].text == NULL) entry = &bucket[i];
+  }
+  
+  for (i = 0; i < RESULT_CACHE_WAYS && entry == NULL; i++)
+  {
+    if (!bucket[i].referenced) entry = &bucket[i];
+  }
+  
+  if (entry == NULL) entry = &bucket[0];
+  if (entry->text != NULL) evictResult(entry);
+  
+  while (result_cache_used + size > result_cache_bytes)
+  {
+    struct cachedResult * victim = &result_cache[result_cache_hand];
+    
+    result_cache_hand = (result_cache_hand + 1) % slots;
+    
+    if (victim->text == NULL) continue;
+    if (victim->referenced) victim->referenced = 0;
+    else evictResult(victim);
+  }
+  
+  entry->text = malloc(size);
+  if (entry->text == NULL) return;
+  
+  memcpy(entry->text, line_buffer, line_length);
+  memcpy(entry->text + line_length, output_capture, output_length);
+  entry->hash = hash;
+  entry->line_length = line_length;
+  entry->output_length = output_length;
+  entry->referenced = 0;
+  result_cache_used += size;
+}
+
+
+
+/******************************************************************************/
+/* printResultCacheStats(void)                                                */
+/*   Prints the lookups, hits, hit rate and size of the result cache to the   */
+/*   standard error stream.                                                   */
+/******************************************************************************/
+void printResultCacheStats(void)
+{
+  fprintf(stderr, "Result cache: lookups: %llu hits: %llu (%.2f%%) "
+          "evictions: %llu bytes: %llu\n",
+          result_cache_lookups, result_cache_hits,
+          result_cache_lookups ?
+            100.0 * result_cache_hits / result_cache_lookups : 0.0,
+          result_cache_evictions, result_cache_used);
+}
+
+
+
+/******************************************************************************/
+/* beginIndexEntry(int line)                                                  */
+/*   Starts the index line of an encrypted line in index_out. The offsets of  */
+/*   its blocks are added by encryptText.                                     */
+/*                                                                            */
+/* Parameters: line: The input line number.                                   */
+/******************************************************************************/
+void beginIndexEntry(int line)
+{
+  fprintf(index_out, "%d %c %d", line, block_format->version, index_every);
+  cipher_offset = 0;
+  index_entry_open = 1;
+}
+
+
+
+/******************************************************************************/
+/* endIndexEntry(void)                                                        */
+/*   Ends the open index line in index_out.                                   */
+/******************************************************************************/
+void endIndexEntry(void)
+{
+  fputc('\n', index_out);
+  index_entry_open = 0;
+}
+
+
+
+/******************************************************************************/
+/* writeIndex(const char * every)                                             */
+/*   Scans the decryption lines of the standard input stream and prints their */
+/*   block indexes to the standard output stream. Other lines are skipped.    */
+/*                                                                            */
+/* Parameters: * every: K, the number of blocks between offsets, or NULL for  */
+/*                      the value of index_every.                             */
+/*                                                                            */
+/* Return: EXIT_SUCCESS | EXIT_FAILURE                                        */
+/******************************************************************************/
+int writeIndex(const char * every)
+{
+  int line = 0;
+  long long block;
+  char * end;
+  
+  if (every != NULL)
+  {
+    index_every = strtol(every, &end, 10);
+    if (index_every <= 0 || * end != '\0')
+    {
+      fprintf(stderr, "Error: Invalid block count %s\n", every);
+      return EXIT_FAILURE;
+    }
+  }
+  
+  index_out = stdout;
+  status = CLEAR;
+  
+  while (status != END_OF_FILE)
+  {
+    line++;
+    
+    status = readCipherMode();
+    if (status == OK && cipher_mode == 1) status = buildLCG();
+    
+    if (status == OK && cipher_mode == 1)
+    {
+      beginIndexEntry(line);
+      
+      for (block = 0; status == OK; block++)
+      {
+        unsigned long long offset = cipher_offset;
+        
+        status = skipBlocks(1);
+        
+        //Only blocks holding cipher text get an offset.
+        if (block > 0 && block % index_every == 0 && cipher_offset > offset)
+        {
+          fprintf(index_out, " %llu", offset);
+        }
+      }
+      
+      endIndexEntry();
+    }
+    else if (status == OK || status == ERROR) skipToEndOfLine();
+  }
+  
+  return EXIT_SUCCESS;
+}
+
+
+
+/******************************************************************************/
+/* readIndexField(unsigned long long * value)                                 */
+/*   Reads the next number of the current line of index_in, skipping spaces.  */
+/*                                                                            */
+/* Parameters: * value: Set to the number read.                               */
+/*                                                                            */
+/* Return: 1 if a number was read, 0 at the end of the line or on an error.   */
+/******************************************************************************/
+int readIndexField(unsigned long long * value)
+{
+  int active_char = fgetc(index_in);
+  
+  while (active_char == ' ') active_char = fgetc(index_in);
+  
+  if (!isdigit(active_char))
+  {
+    if (active_char != EOF) ungetc(active_char, index_in);
+    return 0;
+  }
+  
+  * value = 0;
+  
+  while (isdigit(active_char))
+  {
+    * value = * value * 10 + active_char - '0';
+    active_char = fgetc(index_in);
+  }
+  
+  if (active_char != EOF) ungetc(active_char, index_in);
+  
+  return 1;
+}
+
+
+
+/******************************************************************************/
+/* findIndexOffset(int line, long long block, long long * indexed_block)      */
+/*   Looks up the last indexed block at or before block in the index line     */
+/*   for an input line. Index lines are read forward only, so lines must be   */
+/*   looked up in increasing order.                                           */
+/*                                                                            */
+/* Parameters: line: The input line number.                                   */
+/*             block: The block to seek to.                                   */
+/*             * indexed_block: Set to the block found, 0 if none was.        */
+/*                                                                            */
+/* Return: The cipher text offset of * indexed_block.                         */
+/******************************************************************************/
+unsigned long long findIndexOffset(int line, long long block,
+                                   long long * indexed_block)
+{
+  unsigned long long value;
+  unsigned long long offset = 0;
+  unsigned long long every;
+  long long i;
+  int active_char;
+  
+  * indexed_block = 0;
+  
+  while (index_in_line < line && !feof(index_in))
+  {
+    //Skip the rest of the previous index line.
+    if (index_in_started)
+    {
+      do active_char = fgetc(index_in);
+      while (active_char != '\n' && active_char != EOF);
+    }
+    index_in_started = 1;
+    
+    index_in_line = readIndexField(&value) ? (long long) value : 0;
+  }
+  
+  if (index_in_line != line) return 0;
+  
+  if (!readIndexField(&value) ||
+      value != (unsigned) (block_format->version - '0') ||
+      !readIndexField(&every) || every == 0)
+  {
+    return 0;
+  }
+  
+  for (i = 1; i <= block / (long long) every && readIndexField(&value); i++)
+  {
+    offset = value;
+    * indexed_block = i * every;
+  }
+  
+  return offset;
+}
+
+
+
+/******************************************************************************/
+/* mulMod(unsigned long long x, unsigned long long y)                         */
+/*   Multiplies two numbers modulo lcg_m without overflow.                    */
+/*                                                                            */
+/* Return: (x * y) mod lcg_m                                                  */
+/******************************************************************************/
+unsigned long long mulMod(unsigned long long x, unsigned long long y)
+{
+  return (unsigned __int128) x * y % lcg_m;
+}
+
+
+
+/******************************************************************************/
+/* jumpLCG(unsigned long long steps)                                          */
+/*   Advances lcg_x by steps steps of the LCG.                                */
+/*                                                                            */
+/*   One step is the affine map x -> a * x + c, so n steps are the map        */
+/*   x -> A * x + C that is found by composing the step with itself in        */
+/*   O(log n) time. This only matches stepping one at a time if a step never  */
+/*   overflows before it is reduced modulo lcg_m, or if lcg_m is a power of   */
+/*   two so the overflow does not change the result. Other keys are stepped   */
+/*   one at a time, which is still far cheaper than building their maps.      */
+/*                                                                            */
+/* Parameters: steps: The number of steps to advance.                         */
+/******************************************************************************/
+void jumpLCG(unsigned long long steps)
+{
+  unsigned long long largest = lcg_m - 1 > lcg_c ? lcg_m - 1 : lcg_c;
+  unsigned long long step_a = lcg_a % lcg_m;
+  unsigned long long step_c = lcg_c % lcg_m;
+  unsigned long long total_a = 1 % lcg_m;
+  unsigned long long total_c = 0;
+  
+  if (steps == 0) return;
+  
+  if ((lcg_m & (lcg_m - 1)) != 0 && lcg_a > (ULLONG_MAX - lcg_c) / largest)
+  {
+    while (steps-- > 0) lcg_x = ((lcg_a * lcg_x) + lcg_c) % lcg_m;
+    return;
+  }
+  
+  while (steps > 0)
+  {
+    if (steps & 1)
+    {
+      total_a = mulMod(step_a, total_a);
+      total_c = (mulMod(step_a, total_c) + (unsigned __int128) step_c) % lcg_m;
+    }
+    
+    step_c = (mulMod(step_a, step_c) + (unsigned __int128) step_c) % lcg_m;
+    step_a = mulMod(step_a, step_a);
+    steps >>= 1;
+  }
+  
+  lcg_x = (mulMod(total_a, lcg_x % lcg_m) + (unsigned __int128) total_c) %
+          lcg_m;
+}
+
+
+
+/******************************************************************************/
+/* skipBlocks(long long count)                                                */
+/*   Reads past count blocks of cipher text without decrypting them. Each     */
+/*   character of a block is one byte or a two-byte code starting with '+'.   */
+/*   The bytes read are added to cipher_offset.                               */
+/*                                                                            */
+/* Return: OK | END_OF_LINE | END_OF_FILE                                     */
+/******************************************************************************/
+int skipBlocks(long long count)
+{
+  int i;
+  
+  for (; count > 0; count--)
+  {
+    for (i = 0; i < block_format->block_chars; i++)
+    {
+      int active_char = readChar();
+      
+      if (active_char == '+')
+      {
+        active_char = readChar();
+        cipher_offset++;
+      }
+      
+      if (active_char == '\n') return END_OF_LINE;
+      if (active_char == EOF) return END_OF_FILE;
+      
+      cipher_offset++;
+    }
+  }
+  
+  return OK;
+}
+
+
+
+/******************************************************************************/
+/* seekToRange(int line)                                                      */
+/*   Moves a decryption line to the first block of the range: the cipher      */
+/*   text is skipped up to that block, using index_in if it is open, and the  */
+/*   LCG and map_block are advanced to it.                                    */
+/*                                                                            */
+/* Parameters: line: The input line number.                                   */
+/*                                                                            */
+/* Return: OK | END_OF_LINE | END_OF_FILE                                     */
+/******************************************************************************/
+int seekToRange(int line)
+{
+  long long first_block = range_first / block_format->block_chars;
+  long long indexed_block = 0;
+  unsigned long long offset = 0;
+  
+  if (index_in != NULL)
+  {
+    offset = findIndexOffset(line, first_block, &indexed_block);
+  }
+  
+  for (cipher_offset = 0; cipher_offset < offset; cipher_offset++)
+  {
+    int active_char = readChar();
+    
+    if (active_char == '\n') return END_OF_LINE;
+    if (active_char == EOF) return END_OF_FILE;
+  }
+  
+  status = skipBlocks(first_block - indexed_block);
+  if (status != OK) return status;
+  
+  jumpLCG((unsigned long long) first_block * block_format->block_chars * 7);
+  map_block = first_block;
+  
+  return OK;
+}
+
+
+
+/******************************************************************************/
+/* initCipherStream(struct cipherStream * stream,                             */
+/*                  void (* write)(void *, const char *, size_t),             */
+/*                  void (* endLine)(void *, int), void * user)               */
+/*   Prepares a stream for feedCipherStream. The stream produces the same     */
+/*   output as the standard input stream would, through its callbacks.        */
+/*                                                                            */
+/* Parameters: * stream: The stream to prepare.                               */
+/*             write: Called with each piece of output, which is not null     */
+/*                    terminated.                                             */
+/*             endLine: Called with the input line number once the output of  */
+/*                      a line is complete. May be NULL.                      */
+/*             * user: Passed to both callbacks.                              */
+/******************************************************************************/
+void initCipherStream(struct cipherStream * stream,
+                      void (* write)(void *, const char *, size_t),
+                      void (* endLine)(void *, int), void * user)
+{
+  memset(stream, 0, sizeof(struct cipherStream));
+  stream->write = write;
+  stream->endLine = endLine;
+  stream->user = user;
+  stream->state = STREAM_MODE;
+}
+
+
+
+/******************************************************************************/
+/* feedCipherStream(struct cipherStream * stream, const char * bytes,         */
+/*                  size_t length)                                            */
+/*   Pushes the next chunk of input into a stream. A chunk may end anywhere,  */
+/*   including inside a key or a two-byte code; the stream keeps its place    */
+/*   and output is written as soon as each block is complete, so no more      */
+/*   than one block is ever held.                                             */
+/*                                                                            */
+/*   The output matches reading the standard input stream, except that a      */
+/*   '\n' always ends the line. The line reader skips the next line when it   */
+/*   finds an error on a line's '\n', and it reads past the end of a line to  */
+/*   fill a short last block holding two-byte codes. A stream does neither,   */
+/*   and a '+' right before a '\n' is an error.                               */
+/*                                                                            */
+/*   The global LCG, map and format variables are used as scratch space for   */
+/*   one block at a time, so streams may be interleaved but not fed from      */
+/*   several threads at once. The map cache is not used.                      */
+/*                                                                            */
+/* Parameters: * stream: A stream prepared by initCipherStream.               */
+/*             * bytes: The chunk of input.                                   */
+/*             length: The number of bytes in the chunk.                      */
+/******************************************************************************/
+void feedCipherStream(struct cipherStream * stream,
+                      const char * bytes, size_t length)
+{
+  size_t i;
+  
+  for (i = 0; i < length; i++)
+  {
+    streamChar(stream, (unsigned char) bytes[i]);
+  }
+}
+
+
+
+/******************************************************************************/
+/* finishCipherStream(struct cipherStream * stream)                           */
+/*   Ends the input of a stream, completing its last line as EOF would.       */
+/******************************************************************************/
+void finishCipherStream(struct cipherStream * stream)
+{
+  char prefix[16];
+  
+  switch (stream->state)
   {
-    if (0)
-    {
-      printf("The builtMap[%d] = %d\n", i, builtMap[i]);
-      printf("Is bit %d (%d mod 7 = %d) in decrypted[%d (%d / 7 = %d)] on? ––– %d\n",
-             builtMap[i] % 7, builtMap[i], builtMap[i] % 7, builtMap[i] / 7,
-             builtMap[i], builtMap[i] / 7,
-             isBitSet(decrypted[builtMap[i] / 7], builtMap[i] % 7));
-    }
-    
-    if (isBitSet(decrypted[builtMap[i] / 7], builtMap[i] % 7))
-    {
-      if (DEBUG_BUILT_MAP)
+    case STREAM_MODE:
+      //Like the standard input stream, input ending at the start of a line
+      //ends the output with an empty line, unless the line held only an
+      //invalid version digit.
+      if (stream->line_started && stream->format == NULL)
       {
-        printf("Placing bit at index %d on decrypted_formatted[%d]\n", i % 7, i / 7);
-        printf("(%d, %d) --> (%d, %d)\n\n", builtMap[i] % 7, builtMap[i] / 7, i % 7, i / 7);
+        sprintf(prefix, "%5d) ", stream->line);
+        streamWrite(stream, prefix);
+        streamError(stream, '\n');
       }
-      setBit(&decrypted_formatted[i / 7], i % 7);
-    }
+      else if (stream->line_started) streamEndLine(stream, "\n");
+      else streamWrite(stream, "\n");
+      break;
+    case STREAM_LCG_M:
+    case STREAM_LCG_C:
+    case STREAM_ESCAPE:
+      streamError(stream, '\n');
+      break;
+    case STREAM_DATA:
+      if (stream->data_count > 0 && streamBlock(stream) == ERROR)
+      {
+        streamError(stream, '\n');
+      }
+      else
+      {
+        //Like the standard input stream, a line of data ended by EOF is
+        //followed by an empty line.
+        streamEndLine(stream, "\n");
+        streamWrite(stream, "\n");
+      }
+      break;
+    case STREAM_SKIP:
+      streamEndLine(stream, "");
+      break;
   }
+}
+
+
+
+/******************************************************************************/
+/* streamWrite(struct cipherStream * stream, const char * text)               */
+/*   Sends null terminated output to the write callback of a stream.          */
+/******************************************************************************/
+void streamWrite(struct cipherStream * stream, const char * text)
+{
+  size_t length = strlen(text);
   
-  if (DEBUG_DECRYPT)
+  if (length > 0) stream->write(stream->user, text, length);
+}
+
+
+
+/******************************************************************************/
+/* streamEndLine(struct cipherStream * stream, const char * text)             */
+/*   Writes the last output of the current line, reports the line as done     */
+/*   and waits for the next line.                                             */
+/******************************************************************************/
+void streamEndLine(struct cipherStream * stream, const char * text)
+{
+  streamWrite(stream, text);
+  if (stream->endLine != NULL) stream->endLine(stream->user, stream->line);
+  
+  stream->state = STREAM_MODE;
+  stream->line_started = 0;
+}
+
+
+
+/******************************************************************************/
+/* streamError(struct cipherStream * stream, int active_char)                 */
+/*   Writes "Error" for the current line. If the error was found on the       */
+/*   line's '\n' the line ends, otherwise the rest of the line is skipped.    */
+/******************************************************************************/
+void streamError(struct cipherStream * stream, int active_char)
+{
+  if (active_char == '\n') streamEndLine(stream, "Error\n");
+  else
   {
-    printf("Partially Decrypted ASCII: %d, %d, %d, %d\n",
-           decrypted[0], decrypted[1], decrypted[2], decrypted[3]);
+    streamWrite(stream, "Error\n");
+    stream->state = STREAM_SKIP;
+  }
+}
+
+
+
+/******************************************************************************/
+/* streamNumber(struct cipherStream * stream, int active_char)                */
+/*   Adds one character to the LCG_M or LCG_C number of a stream, following   */
+/*   the rules of readNumber.                                                 */
+/*                                                                            */
+/* Return: OK if the character was a digit, END_OF_LINE if it was the ','     */
+/*         ending a valid number, otherwise ERROR.                            */
+/******************************************************************************/
+int streamNumber(struct cipherStream * stream, int active_char)
+{
+  unsigned long long value;
+  
+  if (active_char == ',')
+  {
+    value = strtoull(stream->digits, NULL, 0);
+    memset(stream->digits, 0, sizeof(stream->digits));
+    stream->digit_count = 0;
     
-    printf("The Partially Decrypted Text: %s\n", decrypted);
+    if (value == 0) return ERROR;
     
-    printf("\nPlain Text ASCII: %d, %d, %d, %d\n",
-           decrypted_formatted[0], decrypted_formatted[1],
-           decrypted_formatted[2], decrypted_formatted[3]);
+    if (stream->state == STREAM_LCG_M) stream->m = value;
+    else stream->c = value;
     
-    printf("The Plain Text: %s\n", decrypted_formatted);
+    return END_OF_LINE;
   }
   
-  for (i = 0; i < 4; i++)
+  if (stream->digit_count == 20 || !isdigit(active_char)) return ERROR;
+  
+  if (active_char != '0' || stream->digit_count > 0)
   {
-    if ((decrypted_formatted[i] > 0 && decrypted_formatted[i] < 32) ||
-        decrypted_formatted[i] == 127)
+    stream->digits[stream->digit_count++] = active_char;
+  }
+  
+  return OK;
+}
+
+
+
+/******************************************************************************/
+/* streamKey(struct cipherStream * stream)                                    */
+/*   Completes the LCG of a stream once its m and c are read, the same way    */
+/*   buildLCG does.                                                           */
+/*                                                                            */
+/* Return: OK | ERROR                                                         */
+/******************************************************************************/
+int streamKey(struct cipherStream * stream)
+{
+  lcg_m = stream->m;
+  lcg_c = stream->c;
+  
+  if (initLCG() == ERROR) return ERROR;
+  
+  block_format = stream->format;
+#ifdef KEYED
+  selectKeyedFormat();
+#endif
+  
+  stream->format = block_format;
+  stream->a = lcg_a;
+  stream->x = lcg_x;
+  stream->block = 0;
+  stream->data_count = 0;
+  memset(stream->data, 0, sizeof(stream->data));
+  
+  return OK;
+}
+
+
+
+/******************************************************************************/
+/* streamBlock(struct cipherStream * stream)                                  */
+/*   Builds the next map of a stream and encrypts or decrypts its buffered    */
+/*   block, writing the result. A partial block is padded with '\0'.          */
+/*                                                                            */
+/* Return: OK | ERROR                                                         */
+/******************************************************************************/
+int streamBlock(struct cipherStream * stream)
+{
+  char encrypted_formatted[2 * MAX_BLOCK_CHARS + 1];
+  char decrypted_formatted[MAX_BLOCK_CHARS + 1];
+  int result = OK;
+  
+  block_format = stream->format;
+  lcg_m = stream->m;
+  lcg_c = stream->c;
+  lcg_a = stream->a;
+  lcg_x = stream->x;
+  map_block = stream->block;
+  
+  block_format->buildMap();
+  
+  stream->x = lcg_x;
+  stream->block++;
+  
+  if (stream->mode == 0)
+  {
+    if (encryptBlock(stream->data, encrypted_formatted) > 0)
     {
-      if (DEBUG_ERROR)
+      streamWrite(stream, encrypted_formatted);
+    }
+  }
+  else
+  {
+    memset(decrypted_formatted, 0, sizeof(decrypted_formatted));
+    
+    result = decryptBlock(stream->data, decrypted_formatted);
+    if (result == OK) streamWrite(stream, decrypted_formatted);
+  }
+  
+  memset(stream->data, 0, sizeof(stream->data));
+  stream->data_count = 0;
+  
+  return result;
+}
+
+
+
+/******************************************************************************/
+/* streamChar(struct cipherStream * stream, int active_char)                  */
+/*   Advances the parser of a stream by one input character.                  */
+/******************************************************************************/
+void streamChar(struct cipherStream * stream, int active_char)
+{
+  char prefix[16];
+  int result;
+  
+  switch (stream->state)
+  {
+    case STREAM_MODE:
+      if (!stream->line_started)
       {
-        printf("Decrypted decrypted_formatted[%d] is out of ASCII range: %d\n",
-               i, decrypted_formatted[i]);
+        stream->line++;
+        stream->line_started = 1;
+        stream->format = findBlockFormat('1');
+        memset(stream->digits, 0, sizeof(stream->digits));
+        stream->digit_count = 0;
+        
+        //A version digit is held until the next character, which starts the
+        //output of the line the way readCipherMode does.
+        if (isdigit(active_char))
+        {
+          stream->format = findBlockFormat(active_char);
+          return;
+        }
       }
-      return ERROR;
-    }
+      
+      sprintf(prefix, "%5d) ", stream->line);
+      streamWrite(stream, prefix);
+      
+      if (stream->format == NULL)
+      {
+        streamError(stream, active_char);
+        return;
+      }
+      
+      if (active_char == 'e' || active_char == 'd')
+      {
+        stream->mode = active_char == 'd';
+        stream->state = STREAM_LCG_M;
+      }
+      else if (active_char == '\n') streamEndLine(stream, "\n");
+      else streamError(stream, active_char);
+      break;
+    
+    case STREAM_LCG_M:
+    case STREAM_LCG_C:
+      result = streamNumber(stream, active_char);
+      
+      if (result == ERROR) streamError(stream, active_char);
+      else if (result == END_OF_LINE)
+      {
+        if (stream->state == STREAM_LCG_M) stream->state = STREAM_LCG_C;
+        else if (streamKey(stream) == ERROR) streamError(stream, active_char);
+        else stream->state = STREAM_DATA;
+      }
+      break;
+    
+    case STREAM_DATA:
+      if (active_char == '\n')
+      {
+        if (stream->data_count > 0 && streamBlock(stream) == ERROR)
+        {
+          streamError(stream, active_char);
+        }
+        else streamEndLine(stream, "\n");
+        return;
+      }
+      
+      if (!isascii(active_char))
+      {
+        streamError(stream, active_char);
+        return;
+      }
+      
+      if (stream->mode == 1 && active_char == '+')
+      {
+        stream->state = STREAM_ESCAPE;
+        return;
+      }
+      
+      stream->data[stream->data_count++] = active_char;
+      
+      if (stream->data_count == stream->format->block_chars &&
+          streamBlock(stream) == ERROR)
+      {
+        streamError(stream, active_char);
+      }
+      break;
+    
+    case STREAM_ESCAPE:
+      if (active_char == '\n')
+      {
+        streamError(stream, active_char);
+        return;
+      }
+      
+      if (active_char == '&') active_char = 127;
+      else if (active_char != '+') active_char -= '@';
+      
+      stream->data[stream->data_count++] = active_char;
+      stream->state = STREAM_DATA;
+      
+      if (stream->data_count == stream->format->block_chars &&
+          streamBlock(stream) == ERROR)
+      {
+        streamError(stream, active_char);
+      }
+      break;
+    
+    case STREAM_SKIP:
+      if (active_char == '\n') streamEndLine(stream, "");
+      break;
+  }
+}
+
+
+
+/******************************************************************************/
+/* writeStreamOutput(void * user, const char * text, size_t length)           */
+/*   Write callback used by --stream. Sends the output to the standard        */
+/*   output stream. In low-latency mode the first output of a line, written   */
+/*   as soon as its first byte arrives, starts the timing of the line.        */
+/******************************************************************************/
+void writeStreamOutput(void * user, const char * text, size_t length)
+{
+  if (latency_mode && !stream_line_open)
+  {
+    clock_gettime(CLOCK_MONOTONIC, &stream_line_start);
+    stream_line_open = 1;
   }
   
-  if (!DEBUG_DECRYPT) printf("%s", decrypted_formatted);
+  fwrite(text, 1, length, stdout);
+}
 
-  free(decrypted);
-  free(decrypted_formatted);
+
+
+/******************************************************************************/
+/* endStreamLine(void * user, int line)                                       */
+/*   Line callback used by --stream. In low-latency mode, flushes the line    */
+/*   and records its latency.                                                 */
+/******************************************************************************/
+void endStreamLine(void * user, int line)
+{
+  if (!latency_mode) return;
   
-  return OK;
+  fflush(stdout);
+  if (stream_line_open) recordLatency(elapsedNanoseconds(&stream_line_start));
+  stream_line_open = 0;
 }
 
 
 
-int main(void)
+/******************************************************************************/
+/* cipherLines(void)                                                          */
+/*   Encrypts or decrypts every line of the standard input stream, printing   */
+/*   the numbered results to the standard output stream.                      */
+/******************************************************************************/
+void cipherLines(void)
 {
   int input_line_number = 0;
+  int line_started;
+  struct timespec line_start;
+  struct cachedResult * cached = NULL;
+  unsigned long long hash = 0;
   status = CLEAR;
   
-  char data[5];
-  data[4] = '\0';
+  char data[MAX_BLOCK_CHARS + 1];
+  data[MAX_BLOCK_CHARS] = '\0';
   
   while (status != END_OF_FILE)
   {
     status = CLEAR;
     input_line_number++;
     
+    if (result_cache_enabled)
+    {
+      bufferLine();
+      hash = hashLine();
+      cached = line_complete && index_out == NULL ? findResult(hash) : NULL;
+    }
+    
     status = readCipherMode();
+    line_started = (status & END_OF_FILE) == 0;
+    
+    //The line is timed from its first byte, so waiting on input is excluded.
+    if (latency_mode) clock_gettime(CLOCK_MONOTONIC, &line_start);
+    
     if (DEBUG_GENERAL)
     {
       printf("\nreadCipherMode: mode = %d status = %d\n", cipher_mode, status);
@@ -813,9 +2923,33 @@ int main(void)
       printf("%5d) ", input_line_number);
     }
     
+    output_length = 0;
+    output_overflow = 0;
+    output_capturing = result_cache_enabled && line_complete && !cached;
+    
+    //Replay all but the final '\n' of a cached line, which is printed below.
+    if (cached != NULL)
+    {
+      fwrite(cached->text + cached->line_length, 1,
+             cached->output_length - 1, stdout);
+      status = line_at_eof ? END_OF_FILE : END_OF_LINE;
+    }
+    
     if (status == OK)
     {
       status = buildLCG();
+#ifdef KEYED
+      if (status == OK) selectKeyedFormat();
+#endif
+      if (status == OK) resetMapCache();
+      if (status == OK && cipher_mode == 1 && range_enabled)
+      {
+        status = seekToRange(input_line_number);
+      }
+      if (status == OK && cipher_mode == 0 && index_out != NULL)
+      {
+        beginIndexEntry(input_line_number);
+      }
       if (DEBUG_GENERAL)
       {
         printf ("\nKey: m = %llu c = %llu a = %llu x = %llu status = %d\n",
@@ -825,6 +2959,14 @@ int main(void)
     
     while (status == OK)
     {
+      //Stop once the last block of the range is decrypted.
+      if (range_enabled && cipher_mode == 1 &&
+          map_block > range_last / block_format->block_chars)
+      {
+        skipToEndOfLine();
+        break;
+      }
+      
       buildMap();
       status = readDataBlock(data);
       if (DEBUG_GENERAL)
@@ -847,11 +2989,163 @@ int main(void)
     
     if (status & ERROR)
     {
-      puts("Error");
+      writeOutput("Error\n");
       skipToEndOfLine();
     }
-    else puts("");
+    else writeOutput("\n");
+    
+    if (index_entry_open) endIndexEntry();
+    
+    if (output_capturing && !output_overflow && !line_overrun &&
+        line_position == line_length)
+    {
+      storeResult(hash);
+    }
+    output_capturing = 0;
+    
+    if (latency_mode)
+    {
+      fflush(stdout);
+      if (line_started) recordLatency(elapsedNanoseconds(&line_start));
+    }
+  }
+}
+
+
+
+#ifndef CIPHER_LIBRARY
+int main(int argc, char ** argv)
+{
+  int i;
+  
+  if (argc == 3 && !strcmp(argv[1], "keygen"))
+  {
+    return writeKeyedSource(argv[2]);
+  }
+  
+  if (argc == 3 && !strcmp(argv[1], "autotune"))
+  {
+    return autotune(argv[2]);
+  }
+  
+  if ((argc == 2 || argc == 3) && !strcmp(argv[1], "index"))
+  {
+    return writeIndex(argc == 3 ? argv[2] : NULL);
+  }
+  
+  for (i = 1; i < argc; i++)
+  {
+    char * end = NULL;
+    char extra;
+    
+    if (!strcmp(argv[i], "-l") || !strcmp(argv[i], "--latency"))
+    {
+      latency_mode = 1;
+    }
+    else if (!strcmp(argv[i], "-s") || !strcmp(argv[i], "--stream"))
+    {
+      stream_mode = 1;
+    }
+    else if (!strcmp(argv[i], "-c") || !strcmp(argv[i], "--cache"))
+    {
+      result_cache_enabled = 1;
+    }
+    else if (!strcmp(argv[i], "--cache-entries") && i + 1 < argc &&
+             (result_cache_entries = strtoull(argv[++i], &end, 10)) > 0 &&
+             result_cache_entries <= RESULT_CACHE_MAX_ENTRIES &&
+             * end == '\0')
+    {
+      result_cache_enabled = 1;
+    }
+    else if (!strcmp(argv[i], "--cache-bytes") && i + 1 < argc &&
+             (result_cache_bytes = strtoull(argv[++i], &end, 10)) > 0 &&
+             * end == '\0')
+    {
+      result_cache_enabled = 1;
+    }
+    else if (!strcmp(argv[i], "--write-index") && i + 1 < argc)
+    {
+      index_out = fopen(argv[++i], "w");
+      if (index_out == NULL)
+      {
+        fprintf(stderr, "Error: Cannot write index %s\n", argv[i]);
+        return EXIT_FAILURE;
+      }
+    }
+    else if (!strcmp(argv[i], "--index-every") && i + 1 < argc &&
+             (index_every = strtol(argv[++i], &end, 10)) > 0 &&
+             * end == '\0')
+    {
+      continue;
+    }
+    else if (!strcmp(argv[i], "--range") && i + 1 < argc &&
+             sscanf(argv[++i], "%lld-%lld%c",
+                    &range_first, &range_last, &extra) == 2 &&
+             range_first >= 0 && range_last >= range_first)
+    {
+      range_enabled = 1;
+    }
+    else if (!strcmp(argv[i], "--index") && i + 1 < argc)
+    {
+      index_in = fopen(argv[++i], "r");
+      if (index_in == NULL)
+      {
+        fprintf(stderr, "Error: Cannot read index %s\n", argv[i]);
+        return EXIT_FAILURE;
+      }
+    }
+    else
+    {
+      fprintf(stderr, "Usage: %s [-l | --latency] [-s | --stream] "
+              "[-c | --cache] [--cache-entries N] [--cache-bytes N]\n",
+              argv[0]);
+      fprintf(stderr, "       %*s [--write-index FILE] [--index-every K] "
+              "[--range X-Y] [--index FILE]\n", (int) strlen(argv[0]), "");
+      fprintf(stderr, "       %s keygen M,C\n", argv[0]);
+      fprintf(stderr, "       %s autotune SAMPLE\n", argv[0]);
+      fprintf(stderr, "       %s index [K]\n", argv[0]);
+      return EXIT_FAILURE;
+    }
+  }
+  
+  if (stream_mode && (result_cache_enabled || index_out != NULL ||
+                      range_enabled || index_in != NULL))
+  {
+    fprintf(stderr, "Error: --stream cannot be used with the result cache, "
+            "--write-index, --range or --index\n");
+    return EXIT_FAILURE;
+  }
+  
+  if (loadProfile() == ERROR) return EXIT_FAILURE;
+  if (result_cache_enabled && initResultCache() == ERROR) return EXIT_FAILURE;
+  
+  if (output_buffer_size > 0 && !isatty(fileno(stdout)))
+  {
+    setvbuf(stdout, stdout_buffer, _IOFBF, output_buffer_size);
+  }
+  
+  if (stream_mode)
+  {
+    struct cipherStream stream;
+    char chunk[STREAM_CHUNK];
+    ssize_t length;
+    
+    initCipherStream(&stream, writeStreamOutput, endStreamLine, NULL);
+    
+    while ((length = read(STDIN_FILENO, chunk, sizeof(chunk))) != 0)
+    {
+      if (length > 0) feedCipherStream(&stream, chunk, length);
+      else if (errno != EINTR) break;
+    }
+    
+    finishCipherStream(&stream);
   }
+  else cipherLines();
+  
+  if (latency_mode) printLatencyHistogram();
+  if (result_cache_enabled) printResultCacheStats();
+  if (index_out != NULL) fclose(index_out);
   
   return EXIT_SUCCESS;
-}
\ No newline at end of file
+}
+#endif
@@ -0,0 +1,82 @@
+/*******************************************************************************
+ * Streaming interface to the cipher, for programs that receive their input in
+ * pieces, such as network services. Build libcipher.a with "make libcipher.a"
+ * and link it together with this header.
+ *
+ * A stream parses the same line format as the cipher program and produces the
+ * same output, see feedCipherStream in cipher.c for the exceptions.
+ *
+ * Example:
+ *
+ *   void write(void * user, const char * text, size_t length)
+ *   {
+ *     fwrite(text, 1, length, stdout);
+ *   }
+ *
+ *   struct cipherStream stream;
+ *
+ *   initCipherStream(&stream, write, NULL, NULL);
+ *   feedCipherStream(&stream, "e38875,1234,Hel", 15);
+ *   feedCipherStream(&stream, "lo\n", 3);
+ *   finishCipherStream(&stream);
+ *
+ * Streams share scratch space inside the library, so they may be interleaved
+ * but not fed from several threads at once.
+ ******************************************************************************/
+
+#ifndef CIPHERSTREAM_H
+#define CIPHERSTREAM_H
+
+#include <stddef.h>
+
+//Widest block any format can use, in characters.
+#define CIPHER_MAX_BLOCK_CHARS 32
+
+struct blockFormat;
+
+//Parser states of a stream.
+enum streamState
+{
+  STREAM_MODE,
+  STREAM_LCG_M,
+  STREAM_LCG_C,
+  STREAM_DATA,
+  STREAM_ESCAPE,
+  STREAM_SKIP
+};
+
+//A cipherStream holds all parser and cipher state of one input stream between
+//calls to feedCipherStream. Its fields are private to the library.
+struct cipherStream
+{
+  void (* write)(void * user, const char * text, size_t length);
+  void (* endLine)(void * user, int line);
+  void * user;
+
+  enum streamState state;
+  int line;
+  int line_started;
+  int mode;
+  const struct blockFormat * format;
+
+  char digits[21];
+  int digit_count;
+
+  unsigned long long m;
+  unsigned long long c;
+  unsigned long long a;
+  unsigned long long x;
+  long long block;
+
+  char data[CIPHER_MAX_BLOCK_CHARS + 1];
+  int data_count;
+};
+
+void initCipherStream(struct cipherStream * stream,
+                      void (* write)(void *, const char *, size_t),
+                      void (* endLine)(void *, int), void * user);
+void feedCipherStream(struct cipherStream * stream,
+                      const char * bytes, size_t length);
+void finishCipherStream(struct cipherStream * stream);
+
+#endif